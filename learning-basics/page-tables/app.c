@@ -0,0 +1,41 @@
+/*
+ * Demo User Program
+ * 
+ * Runs in U-mode and talks to the kernel only through system calls:
+ * 1. Identifies itself with getpid
+ * 2. Prints a progress line for each key pressed, sleeping in the kernel
+ *    while it waits for input
+ * 3. Grows a large heap with sbrk but touches only a few pages of it, which
+ *    the kernel backs on demand
+ * 4. Forks a child that writes to the shared heap and gets its own copy, then
+ *    sleeps for half a second before reporting
+ * 5. Returns from main, which exits the process so the kernel reclaims it
+ */
+
+#include "user.h"
+
+void main(void) {
+  int pid = getpid();
+  printf("starting user process %d\n", pid);
+  // Both processes wait for input; each key press wakes them and one of
+  // them gets the key
+  for (int i = 0; i < 5; i++) {
+    getchar();
+    printf("process %d: step %d\n", pid, i);
+  }
+
+  // Reserve a 1MB heap but only touch every 64KB: just those pages get memory
+  uint8_t *heap = sbrk(1024 * 1024);
+  for (int off = 0; off < 1024 * 1024; off += 64 * 1024)
+    heap[off] = off >> 16;
+  printf("process %d: touched a sparse heap at %p\n", pid, heap);
+
+  // The child starts out sharing every page; its write gets a private copy
+  if (fork() == 0) {
+    heap[0] = 42;
+    sleep(TICK_HZ / 2);
+    printf("process %d: forked from %d, heap[0]=%d\n", getpid(), pid, heap[0]);
+    return;
+  }
+  printf("process %d: done, heap[0]=%d\n", pid, heap[0]);
+}
@@ -0,0 +1,756 @@
+/*
+ * Kernel Benchmark Harness
+ *
+ * Built into the kernel only by `./run.sh bench` (-DBENCH), which boots it
+ * once per hart count and collects the results:
+ * 1. Kernel Benchmarks (bench_main, a kernel thread)
+ *    - Memory: memcpy/memset against a byte loop, alloc_pages, buddy and
+ *      kmalloc churn, map_page, megapage against 4KB kernel mappings
+ *    - Scheduling: yield ping-pong with and without ASIDs and behind queued
+ *      processes, spawn/exit storms, CPU-bound throughput, lock contention
+ *    - Time: timer arm/cancel, expiry jitter, sleep accuracy, idle time
+ *    - Output: snprintf, console throughput per output path, trace() cost
+ *
+ * 2. User Benchmarks
+ *    - bench_user.c is built as the user image and run last; it prints its
+ *      own results (system calls, page faults, heap shrinking, fork)
+ *
+ * 3. Shutdown
+ *    - Through the SBI system reset extension, which ends QEMU
+ *
+ * Every result is one line of JSON: {"bench":"name","value":N,"unit":"..."}
+ * Benchmarks that need two processes to share a hart only run on one hart,
+ * since idle harts steal queued work.
+ */
+
+#include "kernel.h"
+#include "common.h"
+
+extern char __kernel_base[], __free_ram[], __free_ram_end[];
+extern char _binary_app_bin_start[], _binary_app_bin_size[];
+extern struct cpu cpus[MAX_HARTS];
+extern uint32_t nr_cpus;
+extern struct spinlock proc_lock;
+extern struct list_node proc_list;
+extern bool console_dbcn, uart_ready;
+extern uint32_t *kernel_page_table;
+extern uint32_t asid_max;
+extern uint32_t zero_pool_hits, zero_pool_misses;
+extern struct latency_hist sched_wait;
+extern uint32_t tlb_batches, tlb_remote_fences, tlb_harts_skipped,
+    tlb_lazy_flushes, tlb_flush_ticks;
+
+#define BUF_PAGES 16               // Copy buffers: 64KB
+#define BUDDY_CHURN_OPS 2000000    // alloc_pages/free_pages stress operations
+#define CHURN_OPS 50000            // kmalloc churn operations
+#define CHURN_SLOTS 256            // Live allocations during churn
+#define MAP_PAGES 4096             // map_page calls (16MB of mappings)
+#define PINGPONG_YIELDS 20000      // Yields by each ping-pong thread
+#define SPAWN_PROCS 1000           // Processes per spawn/exit storm
+#define CPU_WORKERS 8              // CPU-bound threads
+#define CPU_WORK 5000000           // Loop iterations per CPU-bound thread
+#define LOCK_ROUNDS 20000          // Lock acquisitions per contending thread
+#define BENCH_TIMERS 1024          // Timers armed at once
+#define TIMER_OPS 100000           // Total timer_arm (and timer_cancel) calls
+#define JITTER_TIMERS 256          // One-shot timers sampled for jitter
+#define SLEEP_SAMPLES 50           // sleep_jiffies calls sampled for accuracy
+
+// Shared with the threads each benchmark spawns
+static volatile uint32_t bench_done; // Threads finished, updated atomically
+static volatile uint32_t bench_ready; // Ping-pong threads started
+static volatile bool bench_stop;     // Tells background threads to exit
+static volatile uint32_t bench_sink; // Keeps computed values alive
+static uint64_t pingpong_start, pingpong_end;
+static uint32_t lock_kind;           // 0: spinlock, 1: ticketlock
+static struct spinlock bench_spinlock;
+static struct ticketlock bench_ticketlock;
+static uint32_t lock_counter;
+static struct timer bench_timers[BENCH_TIMERS];
+static uint32_t bench_delays[BENCH_TIMERS];
+static uint32_t samples[JITTER_TIMERS];
+static uint32_t samples_taken;
+static paddr_t churn_pages[CHURN_SLOTS];
+static uint32_t churn_counts[CHURN_SLOTS];
+static void *churn_objs[CHURN_SLOTS];
+
+// Helpers
+// One result line
+static void report(const char *name, uint64_t value, const char *unit) {
+  printf("{\"bench\":\"%s\",\"value\":%llu,\"unit\":\"%s\"}\n", name, value,
+         unit);
+}
+
+// Helpers
+// One result line for a benchmark run at several sizes: name/param
+static void report_at(const char *name, uint32_t param, uint64_t value,
+                      const char *unit) {
+  char full[48];
+  snprintf(full, sizeof(full), "%s/%u", name, param);
+  report(full, value, unit);
+}
+
+// Helpers
+// Cycle counter, readable here because cpu_online opens it in scounteren
+static uint64_t read_cycles(void) {
+  uint32_t hi, lo, hi2;
+  do {
+    __asm__ __volatile__("rdcycleh %0" : "=r"(hi));
+    __asm__ __volatile__("rdcycle %0" : "=r"(lo));
+    __asm__ __volatile__("rdcycleh %0" : "=r"(hi2));
+  } while (hi != hi2);
+  return ((uint64_t)hi << 32) | lo;
+}
+
+// Helpers
+// xorshift32: cheap, repeatable pseudo-random numbers
+static uint32_t rand_state = 2463534242u;
+static uint32_t bench_rand(void) {
+  rand_state ^= rand_state << 13;
+  rand_state ^= rand_state >> 17;
+  rand_state ^= rand_state << 5;
+  return rand_state;
+}
+
+// Helpers
+// Nanoseconds per operation for n operations taking ticks of the time CSR
+static uint64_t ns_per_op(uint64_t ticks, uint32_t n) {
+  return div_u64(ticks * (1000000000 / TIMEBASE_HZ), n);
+}
+
+// Helpers
+// Operations per second for n operations taking ticks of the time CSR
+static uint64_t per_second(uint64_t n, uint64_t ticks) {
+  return div_u64(n * TIMEBASE_HZ, ticks ? (uint32_t)ticks : 1);
+}
+
+// Helpers
+// Share of part in whole, in percent
+static uint32_t percent(uint32_t part, uint32_t whole) {
+  return whole ? (uint32_t)div_u64((uint64_t)part * 100, whole) : 0;
+}
+
+// Helpers
+// Processes alive other than the idle ones (pid 0)
+static uint32_t live_processes(void) {
+  uint32_t live = 0;
+  spin_lock(&proc_lock);
+  for (struct list_node *n = proc_list.next; n != &proc_list; n = n->next) {
+    if (container_of(n, struct process, all_node)->pid != 0)
+      live++;
+  }
+  spin_unlock(&proc_lock);
+  return live;
+}
+
+// Helpers
+// Sleep until only live processes are left, so every thread a benchmark
+// spawned has exited and been reaped (reaping happens in the idle loop)
+static void wait_for_processes(uint32_t live) {
+  while (live_processes() > live)
+    sleep_jiffies(1);
+}
+
+// Helpers
+// Spin until n spawned threads have counted themselves done, yielding so
+// they get to run on this hart too
+static void wait_done(uint32_t n) {
+  while (__atomic_load_n(&bench_done, __ATOMIC_SEQ_CST) < n)
+    yeild();
+}
+
+// Helpers
+static void thread_done(void) {
+  __atomic_fetch_add(&bench_done, 1, __ATOMIC_SEQ_CST);
+}
+
+// Helpers
+// Start a kernel thread running fn at priority
+static void spawn(void (*fn)(void), int priority) {
+  struct process *proc = create_process((uint32_t)fn);
+  set_priority(proc, priority);
+  wake_up_new(proc);
+}
+
+// Helpers
+// Sort values ascending (insertion sort, the sample counts are small)
+static void sort_samples(uint32_t *values, uint32_t n) {
+  for (uint32_t i = 1; i < n; i++) {
+    uint32_t value = values[i];
+    uint32_t j = i;
+    for (; j > 0 && values[j - 1] > value; j--)
+      values[j] = values[j - 1];
+    values[j] = value;
+  }
+}
+
+// Helpers
+// Report p50, p99 and the maximum of n samples in timer ticks, in microseconds
+static void report_spread(const char *name, uint32_t *values, uint32_t n) {
+  char full[48];
+  sort_samples(values, n);
+  snprintf(full, sizeof(full), "%s_p50", name);
+  report(full, values[n / 2] / (TIMEBASE_HZ / 1000000), "us");
+  snprintf(full, sizeof(full), "%s_p99", name);
+  report(full, values[n * 99 / 100] / (TIMEBASE_HZ / 1000000), "us");
+  snprintf(full, sizeof(full), "%s_max", name);
+  report(full, values[n - 1] / (TIMEBASE_HZ / 1000000), "us");
+}
+
+// Memory
+// memcpy and memset against the byte-at-a-time copy they replaced, from
+// 1 byte to 64KB
+static void bench_copy(void) {
+  uint8_t *src = (uint8_t *)alloc_pages(BUF_PAGES);
+  uint8_t *dst = (uint8_t *)alloc_pages(BUF_PAGES);
+  for (uint32_t size = 1; size <= BUF_PAGES * PAGE_SIZE; size *= 4) {
+    uint32_t rounds = (1u << 22) / size;
+    if (rounds > 100000)
+      rounds = 100000;
+
+    // volatile keeps the compiler from turning the loop back into memcpy
+    uint64_t start = read_cycles();
+    for (uint32_t round = 0; round < rounds; round++) {
+      volatile uint8_t *d = dst;
+      const volatile uint8_t *s = src;
+      for (uint32_t i = 0; i < size; i++)
+        d[i] = s[i];
+    }
+    report_at("copy_bytewise", size, div_u64(read_cycles() - start, rounds),
+              "cycles");
+
+    start = read_cycles();
+    for (uint32_t round = 0; round < rounds; round++)
+      memcpy(dst, src, size);
+    report_at("memcpy", size, div_u64(read_cycles() - start, rounds), "cycles");
+
+    start = read_cycles();
+    for (uint32_t round = 0; round < rounds; round++)
+      memset(dst, (int)round, size);
+    report_at("memset", size, div_u64(read_cycles() - start, rounds), "cycles");
+  }
+  free_pages((paddr_t)src, BUF_PAGES);
+  free_pages((paddr_t)dst, BUF_PAGES);
+}
+
+// Memory
+// Page allocator fast paths, and how often the zeroed pool served them
+static void bench_alloc(void) {
+  uint32_t hits = zero_pool_hits, misses = zero_pool_misses;
+  uint64_t start = read_time();
+  for (uint32_t i = 0; i < 20000; i++)
+    free_pages(alloc_pages(1), 1);
+  report("alloc_free_page", ns_per_op(read_time() - start, 20000), "ns");
+  report("zero_pool_hit_rate",
+         percent(zero_pool_hits - hits,
+                 zero_pool_hits - hits + zero_pool_misses - misses),
+         "%");
+
+  start = read_time();
+  for (uint32_t i = 0; i < 2000; i++)
+    free_pages(alloc_pages(16), 16);
+  report("alloc_free_16_pages", ns_per_op(read_time() - start, 2000), "ns");
+}
+
+// Memory
+// Stress the page allocator with millions of random allocations of 1 to 8
+// pages (half of them single pages) and frees, then check every page came back
+// Nothing else allocates pages while this runs, so any difference is a leak or
+// a page freed twice.
+static void bench_buddy_churn(void) {
+  uint32_t before = free_memory_pages();
+  uint64_t start = read_time();
+  for (uint32_t op = 0; op < BUDDY_CHURN_OPS; op++) {
+    uint32_t slot = bench_rand() % CHURN_SLOTS;
+    if (churn_pages[slot]) {
+      free_pages(churn_pages[slot], churn_counts[slot]);
+      churn_pages[slot] = 0;
+    } else {
+      uint32_t order = __builtin_ctz(bench_rand() | 8);
+      churn_counts[slot] = 1u << order;
+      churn_pages[slot] = alloc_pages(churn_counts[slot]);
+    }
+  }
+  report("buddy_churn", ns_per_op(read_time() - start, BUDDY_CHURN_OPS), "ns");
+
+  for (uint32_t slot = 0; slot < CHURN_SLOTS; slot++) {
+    if (churn_pages[slot])
+      free_pages(churn_pages[slot], churn_counts[slot]);
+    churn_pages[slot] = 0;
+  }
+  uint32_t after = free_memory_pages();
+  if (after != before)
+    PANIC("buddy churn: %u free pages before, %u after", before, after);
+  report("buddy_churn_leaked", 0, "pages");
+}
+
+// Memory
+// Random kmalloc sizes up to 2KB, then how much of the memory the slabs took
+// holds live objects once every slot is filled
+static void bench_kmalloc_churn(void) {
+  uint32_t before = free_memory_pages();
+  uint64_t start = read_time();
+  for (uint32_t op = 0; op < CHURN_OPS; op++) {
+    uint32_t slot = bench_rand() % CHURN_SLOTS;
+    if (churn_objs[slot]) {
+      kfree(churn_objs[slot]);
+      churn_objs[slot] = NULL;
+    } else {
+      churn_counts[slot] = bench_rand() % (2u << (bench_rand() % 11)) + 1;
+      churn_objs[slot] = kmalloc(churn_counts[slot]);
+    }
+  }
+  report("kmalloc_churn", ns_per_op(read_time() - start, CHURN_OPS), "ns");
+
+  uint32_t requested = 0;
+  for (uint32_t slot = 0; slot < CHURN_SLOTS; slot++) {
+    if (!churn_objs[slot]) {
+      churn_counts[slot] = bench_rand() % (2u << (bench_rand() % 11)) + 1;
+      churn_objs[slot] = kmalloc(churn_counts[slot]);
+    }
+    requested += churn_counts[slot];
+  }
+  uint32_t after = free_memory_pages();
+  uint32_t used = before > after ? before - after : 0;
+  report("kmalloc_utilization", percent(requested, used * PAGE_SIZE), "%");
+
+  for (uint32_t slot = 0; slot < CHURN_SLOTS; slot++) {
+    kfree(churn_objs[slot]);
+    churn_objs[slot] = NULL;
+  }
+}
+
+// Memory
+// Free the second-level tables of a table built by map_page, then the table
+static void free_table(uint32_t *table1) {
+  for (uint32_t vpn1 = 0; vpn1 < 1024; vpn1++) {
+    if ((table1[vpn1] & PAGE_V) && !(table1[vpn1] & PAGE_RWX))
+      free_pages((table1[vpn1] >> 10) * PAGE_SIZE, 1);
+  }
+  free_pages((paddr_t)table1, 1);
+}
+
+// Memory
+// map_page into an empty table, second-level table allocations included
+static void bench_map_page(void) {
+  uint32_t *table1 = (uint32_t *)alloc_pages(1);
+  paddr_t page = alloc_pages(1);
+  uint64_t start = read_time();
+  for (uint32_t i = 0; i < MAP_PAGES; i++)
+    map_page(table1, USER_BASE + i * PAGE_SIZE, page, PAGE_R | PAGE_W | PAGE_U);
+  report("map_page", ns_per_op(read_time() - start, MAP_PAGES), "ns");
+  free_table(table1);
+  free_pages(page, 1);
+}
+
+// Memory
+// Cycles per load striding a page at a time through free RAM, with the TLB
+// flushed first, under the page table given
+// Interrupts stay masked so nothing else runs on the borrowed table.
+static uint64_t touch_free_ram(uint32_t *table1) {
+  uint32_t irq = irq_save();
+  uint32_t old_satp = READ_CSR(satp);
+  WRITE_CSR(satp, SATP_SV32 | ((uint32_t)table1 / PAGE_SIZE));
+  __asm__ __volatile__("sfence.vma" ::: "memory");
+
+  uint32_t pages = ((paddr_t)__free_ram_end - (paddr_t)__free_ram) / PAGE_SIZE;
+  uint32_t sum = 0;
+  uint64_t start = 0;
+  for (uint32_t pass = 0; pass < 4; pass++) {
+    if (pass == 1)
+      start = read_cycles(); // Pass 0 only warms the caches
+    for (uint32_t i = 0; i < pages; i++)
+      sum += *(volatile uint32_t *)(__free_ram + i * PAGE_SIZE);
+  }
+  uint64_t cycles = read_cycles() - start;
+
+  WRITE_CSR(satp, old_satp);
+  __asm__ __volatile__("sfence.vma" ::: "memory");
+  irq_restore(irq);
+  bench_sink = sum;
+  return div_u64(cycles, 3 * pages);
+}
+
+// Memory
+// The kernel's megapage mappings against the same range mapped 4KB at a time
+// The 4KB table is a copy of the kernel's with every megapage replaced by
+// map_page calls; its other entries still share the kernel's tables.
+static void bench_megapages(void) {
+  uint32_t *table1 = (uint32_t *)alloc_pages(1);
+  memcpy(table1, kernel_page_table, PAGE_SIZE);
+  for (uint32_t vpn1 = 0; vpn1 < 1024; vpn1++) {
+    if (table1[vpn1] & PAGE_RWX)
+      table1[vpn1] = 0;
+  }
+  for (paddr_t addr = (paddr_t)__kernel_base; addr < (paddr_t)__free_ram_end;
+       addr += PAGE_SIZE) {
+    uint32_t vpn1 = (addr >> 22) & TEN_ON_BITS;
+    if (table1[vpn1] != kernel_page_table[vpn1])
+      map_page(table1, addr, addr, PAGE_R | PAGE_W | PAGE_X | PAGE_G);
+  }
+
+  report("ram_touch_megapages", touch_free_ram(kernel_page_table), "cycles");
+  report("ram_touch_4k_pages", touch_free_ram(table1), "cycles");
+
+  // Only the second-level tables built above belong to table1
+  for (uint32_t vpn1 = 0; vpn1 < 1024; vpn1++) {
+    if (table1[vpn1] == kernel_page_table[vpn1])
+      table1[vpn1] = 0;
+  }
+  free_table(table1);
+}
+
+// Scheduling
+// One side of a yield ping-pong; with two of them on one hart every yield
+// switches to the other
+static void pingpong_thread(void) {
+  // Neither side starts counting until both exist
+  __atomic_fetch_add(&bench_ready, 1, __ATOMIC_SEQ_CST);
+  while (__atomic_load_n(&bench_ready, __ATOMIC_SEQ_CST) < 2)
+    yeild();
+  uint64_t start = read_time();
+  for (uint32_t i = 0; i < PINGPONG_YIELDS; i++)
+    yeild();
+  uint64_t end = read_time();
+  // The first thread starts first and the last one ends last
+  if (!pingpong_start)
+    pingpong_start = start;
+  pingpong_end = end;
+  thread_done();
+}
+
+// Scheduling
+// Nanoseconds per context switch between two kernel threads
+// They outrank this thread, which keeps the higher priority until both exist:
+// preempted in between, the first would yield to itself waiting for the
+// second forever.
+static uint64_t run_pingpong(void) {
+  uint32_t live = live_processes();
+  pingpong_start = pingpong_end = 0;
+  bench_ready = 0;
+  bench_done = 0;
+  set_priority(curr_proc, PRIO_DEFAULT - 2);
+  spawn(pingpong_thread, PRIO_DEFAULT - 1);
+  spawn(pingpong_thread, PRIO_DEFAULT - 1);
+  set_priority(curr_proc, PRIO_DEFAULT);
+  wait_done(2);
+  wait_for_processes(live);
+  return ns_per_op(pingpong_end - pingpong_start, 2 * PINGPONG_YIELDS);
+}
+
+// Scheduling
+// Background thread for bench_sched_scaling: queued but never picked while
+// the ping-pong runs at a higher priority
+static void background_thread(void) {
+  while (!bench_stop)
+    yeild();
+}
+
+// Scheduling
+// Context switches, then with more and more lower priority processes queued,
+// which picking the next process should not notice
+// The cost without ASIDs comes from a build with -DASIDS=0 (asid_max 0).
+static void bench_switch(void) {
+  report("yield_pingpong", run_pingpong(), "ns");
+
+  static const uint32_t queued[] = {0, 64, 256, 1024};
+  for (uint32_t i = 0; i < sizeof(queued) / sizeof(queued[0]); i++) {
+    uint32_t live = live_processes();
+    bench_stop = false;
+    for (uint32_t n = 0; n < queued[i]; n++)
+      spawn(background_thread, PRIO_LEVELS - 1);
+    report_at("yield_pingpong_queued", queued[i], run_pingpong(), "ns");
+    bench_stop = true;
+    wait_for_processes(live);
+  }
+}
+
+// Scheduling
+static void noop_thread(void) {
+  thread_done();
+}
+
+// Scheduling
+// Processes created, run and exited per second, and whether exiting gives
+// back everything creating took (after a warm-up that fills the slab caches)
+static void bench_spawn(void) {
+  uint32_t live = live_processes();
+  bench_done = 0;
+  for (uint32_t i = 0; i < 64; i++)
+    spawn(noop_thread, PRIO_DEFAULT);
+  wait_done(64);
+  wait_for_processes(live);
+
+  uint32_t before = free_memory_pages();
+  bench_done = 0;
+  uint64_t start = read_time();
+  for (uint32_t i = 0; i < SPAWN_PROCS; i++)
+    spawn(noop_thread, PRIO_DEFAULT);
+  wait_done(SPAWN_PROCS);
+  report("spawn_exit", per_second(SPAWN_PROCS, read_time() - start), "procs/s");
+  wait_for_processes(live);
+  uint32_t after = free_memory_pages();
+  report("spawn_exit_leaked", before > after ? before - after : 0, "pages");
+}
+
+// Scheduling
+static void cpu_thread(void) {
+  uint32_t x = 1;
+  for (uint32_t i = 0; i < CPU_WORK; i++)
+    x = x * 1664525 + 1013904223;
+  bench_sink = x;
+  thread_done();
+}
+
+// Scheduling
+// Throughput of CPU-bound threads spread over the harts, and how long they
+// waited in run queues meanwhile
+static void bench_throughput(void) {
+  uint32_t live = live_processes();
+  memset(&sched_wait, 0, sizeof(sched_wait));
+  bench_done = 0;
+  uint64_t start = read_time();
+  for (uint32_t i = 0; i < CPU_WORKERS; i++)
+    spawn(cpu_thread, PRIO_DEFAULT);
+  wait_done(CPU_WORKERS);
+  uint64_t ticks = read_time() - start;
+  report("cpu_throughput",
+         div_u64(per_second((uint64_t)CPU_WORKERS * CPU_WORK, ticks), 1000),
+         "kiter/s");
+  report("sched_wait_p50", latency_percentile(&sched_wait, 50), "ticks");
+  report("sched_wait_p99", latency_percentile(&sched_wait, 99), "ticks");
+  wait_for_processes(live);
+}
+
+// Scheduling
+static void lock_thread(void) {
+  for (uint32_t i = 0; i < LOCK_ROUNDS; i++) {
+    if (lock_kind == 0) {
+      spin_lock(&bench_spinlock);
+      lock_counter++;
+      spin_unlock(&bench_spinlock);
+    } else {
+      ticket_lock(&bench_ticketlock);
+      lock_counter++;
+      ticket_unlock(&bench_ticketlock);
+    }
+  }
+  thread_done();
+}
+
+// Scheduling
+// One thread per hart hammering a spinlock, then a ticket lock
+static void bench_locks(void) {
+  static const char *names[] = {"spinlock", "ticketlock"};
+  struct lock_stats *stats[] = {&bench_spinlock.stats, &bench_ticketlock.stats};
+  spin_init(&bench_spinlock, "bench_spin");
+  ticket_init(&bench_ticketlock, "bench_ticket");
+  uint32_t threads = nr_cpus > 1 ? nr_cpus : 2;
+
+  for (lock_kind = 0; lock_kind < 2; lock_kind++) {
+    uint32_t live = live_processes();
+    uint32_t acquired = stats[lock_kind]->acquired;
+    uint32_t contended = stats[lock_kind]->contended;
+    bench_done = 0;
+    uint64_t start = read_time();
+    for (uint32_t i = 0; i < threads; i++)
+      spawn(lock_thread, PRIO_DEFAULT);
+    wait_done(threads);
+    uint64_t ticks = read_time() - start;
+    char name[32];
+    snprintf(name, sizeof(name), "%s_acquire", names[lock_kind]);
+    report(name, ns_per_op(ticks, threads * LOCK_ROUNDS), "ns");
+    snprintf(name, sizeof(name), "%s_contended", names[lock_kind]);
+    report(name,
+           percent(stats[lock_kind]->contended - contended,
+                   stats[lock_kind]->acquired - acquired),
+           "%");
+    wait_for_processes(live);
+  }
+}
+
+// Time
+static void timer_noop(void *arg) {
+  (void)arg;
+}
+
+// Time
+// Called with timer_lock held: record how late each timer fired
+static void timer_sample(void *arg) {
+  struct timer *timer = arg;
+  uint64_t now = read_time();
+  if (samples_taken < JITTER_TIMERS)
+    samples[samples_taken++] = now > timer->due ? (uint32_t)(now - timer->due) : 0;
+}
+
+// Time
+// timer_arm and timer_cancel with BENCH_TIMERS timers pending at random
+// delays, then how late one-shot timers fire
+static void bench_timers_run(void) {
+  for (uint32_t i = 0; i < BENCH_TIMERS; i++) {
+    timer_setup(&bench_timers[i], timer_noop, NULL);
+    bench_delays[i] = 1000 + bench_rand() % 100000;
+  }
+  uint32_t rounds = TIMER_OPS / BENCH_TIMERS;
+  uint64_t arm_ticks = 0, cancel_ticks = 0;
+  for (uint32_t round = 0; round < rounds; round++) {
+    uint64_t start = read_time();
+    for (uint32_t i = 0; i < BENCH_TIMERS; i++)
+      timer_arm(&bench_timers[i], bench_delays[(i + round) % BENCH_TIMERS], 0);
+    uint64_t armed = read_time();
+    for (uint32_t i = 0; i < BENCH_TIMERS; i++)
+      timer_cancel(&bench_timers[i]);
+    arm_ticks += armed - start;
+    cancel_ticks += read_time() - armed;
+  }
+  report("timer_arm", ns_per_op(arm_ticks, rounds * BENCH_TIMERS), "ns");
+  report("timer_cancel", ns_per_op(cancel_ticks, rounds * BENCH_TIMERS), "ns");
+
+  // Delays up to 150 jiffies also go through the second wheel level
+  samples_taken = 0;
+  for (uint32_t i = 0; i < JITTER_TIMERS; i++) {
+    timer_setup(&bench_timers[i], timer_sample, &bench_timers[i]);
+    timer_arm(&bench_timers[i], 1 + bench_rand() % 150, 0);
+  }
+  while (__atomic_load_n(&samples_taken, __ATOMIC_SEQ_CST) < JITTER_TIMERS)
+    sleep_jiffies(1);
+  report_spread("timer_late", samples, JITTER_TIMERS);
+}
+
+// Time
+// Time every online hart has spent in wfi
+static uint64_t total_idle_time(void) {
+  uint64_t idle = 0;
+  for (uint32_t hartid = 0; hartid < MAX_HARTS; hartid++) {
+    if (cpus[hartid].online)
+      idle += cpu_idle_time(&cpus[hartid]);
+  }
+  return idle;
+}
+
+// Time
+// How long past its deadline sleep_jiffies returns, then how idle the harts
+// are over one quiet second
+static void bench_sleep(void) {
+  for (uint32_t i = 0; i < SLEEP_SAMPLES; i++) {
+    uint32_t n = 1 + i % 4;
+    uint64_t start = read_time();
+    sleep_jiffies(n);
+    uint64_t late = read_time() - start;
+    samples[i] = late > n * JIFFY_TICKS ? (uint32_t)(late - n * JIFFY_TICKS) : 0;
+  }
+  report_spread("sleep_late", samples, SLEEP_SAMPLES);
+
+  uint64_t idle_before = total_idle_time();
+  uint64_t start = read_time();
+  sleep_jiffies(TICK_HZ);
+  uint64_t ticks = read_time() - start;
+  uint64_t idle = total_idle_time() - idle_before;
+  // Scaled down by 2^10 ticks to fit percent's 32-bit arguments
+  report("idle", percent((uint32_t)(idle >> 10),
+                         (uint32_t)((ticks * nr_cpus) >> 10)),
+         "%");
+}
+
+// Output
+// Console throughput through the UART, the SBI debug console and the legacy
+// SBI putchar, each timed until the output has fully drained
+// Output from elsewhere keeps going through the default backend.
+static void bench_console_path(const char *name, uint32_t backend) {
+  console_flush();
+  char line[96];
+  uint32_t chars = 0;
+  uint64_t start = read_time();
+  for (uint32_t i = 0; i < 50; i++) {
+    int len = snprintf(line, sizeof(line),
+                       "console bench line %u: the quick brown fox jumps over "
+                       "the lazy dog\n",
+                       i);
+    console_write_to(line, len, backend);
+    chars += len;
+  }
+  console_flush_to(backend);
+  report(name, per_second(chars, read_time() - start), "chars/s");
+}
+
+// Output
+// snprintf throughput, console paths, and the cost of one trace event
+static void bench_output(void) {
+  char buf[64];
+  uint64_t start = read_time();
+  for (uint32_t i = 0; i < 100000; i++)
+    snprintf(buf, sizeof(buf), "pid %d at %x: %s %u", (int)i, i * PAGE_SIZE,
+             "bench", i);
+  report("snprintf", ns_per_op(read_time() - start, 100000), "ns");
+
+  if (uart_ready)
+    bench_console_path("console_uart", CONSOLE_UART);
+  if (console_dbcn)
+    bench_console_path("console_dbcn", CONSOLE_DBCN);
+  bench_console_path("console_legacy", CONSOLE_LEGACY);
+
+  start = read_cycles();
+  for (uint32_t i = 0; i < 100000; i++)
+    trace(TRACE_MARK, i, 0);
+  report("trace_event", div_u64(read_cycles() - start, 100000), "cycles");
+}
+
+// User
+// Run the U-mode half (bench_user.c), which forks, and wait for all of it
+static void bench_user(void) {
+  uint32_t batches = tlb_batches, fences = tlb_remote_fences;
+  uint32_t skipped = tlb_harts_skipped, lazy = tlb_lazy_flushes;
+  uint32_t flush_ticks = tlb_flush_ticks;
+  uint32_t live = live_processes();
+  create_user_process(_binary_app_bin_start, (size_t)_binary_app_bin_size);
+  wait_for_processes(live);
+
+  report("tlb_batches", tlb_batches - batches, "batches");
+  report("tlb_remote_fences", tlb_remote_fences - fences, "fences");
+  report("tlb_harts_skipped", tlb_harts_skipped - skipped, "harts");
+  report("tlb_lazy_flushes", tlb_lazy_flushes - lazy, "flushes");
+  if (tlb_batches != batches)
+    report("tlb_flush", ns_per_op(tlb_flush_ticks - flush_ticks,
+                                  tlb_batches - batches),
+           "ns");
+}
+
+// Power off through the SBI system reset extension, which ends QEMU
+__attribute__((noreturn)) static void shutdown(void) {
+  console_flush();
+  struct ret_sbi ret = call_sbi(SBI_SRST_SHUTDOWN, 0, 0, 0, 0, 0,
+                                SBI_SRST_RESET, SBI_EXT_SRST);
+  PANIC("system reset failed: %d", ret.err);
+}
+
+// Harness entry: run every benchmark in turn, then power off
+void bench_main(void) {
+  // The other harts come online on their own; give them time to
+  sleep_jiffies(TICK_HZ / 10);
+  report("harts", nr_cpus, "harts");
+  report("asid_max", asid_max, "asids");
+  report("tickless", TICKLESS, "bool");
+  report("trace", TRACE, "bool");
+
+  bench_copy();
+  bench_alloc();
+  bench_buddy_churn();
+  bench_kmalloc_churn();
+  bench_map_page();
+  if (nr_cpus == 1) {
+    bench_megapages();
+    bench_switch();
+  }
+  bench_spawn();
+  bench_throughput();
+  bench_locks();
+  bench_timers_run();
+  bench_sleep();
+  bench_output();
+  bench_user();
+
+  // Mostly the user benchmarks' events by now, for trace.py bench-<harts>.log
+  stats_report();
+  trace_dump();
+  printf("bench: done\n");
+  shutdown();
+}
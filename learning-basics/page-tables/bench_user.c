@@ -0,0 +1,131 @@
+/*
+ * User Benchmark Program
+ *
+ * Built in place of app.c by `./run.sh bench`; bench.c runs it after the
+ * kernel benchmarks and waits for it and its children to exit:
+ * 1. Trap entry: getpid round trips take the fast path (caller-saved registers
+ *    only), ebreak round trips the full path every exception takes
+ * 2. Demand-zero faults over a fresh heap, the full trap path plus a page
+ * 3. Heap grow, touch and shrink cycles, which unmap pages in TLB batches
+ * 4. fork of 1MB, 16MB and 48MB heaps: copy-on-write fork latency, the same
+ *    plus the child writing every page, and fork_copy, which copies every page
+ *    during the call
+ *
+ * Results are printed in the same JSON lines as bench.c.
+ */
+
+#include "user.h"
+
+#define MB (1024 * 1024)
+
+// time and cycle CSRs, readable from U-mode because the kernel opens them in
+// scounteren
+static uint64_t read_time(void) {
+  uint32_t hi, lo, hi2;
+  do {
+    __asm__ __volatile__("rdtimeh %0" : "=r"(hi));
+    __asm__ __volatile__("rdtime %0" : "=r"(lo));
+    __asm__ __volatile__("rdtimeh %0" : "=r"(hi2));
+  } while (hi != hi2);
+  return ((uint64_t)hi << 32) | lo;
+}
+
+static uint32_t read_cycles(void) {
+  uint32_t cycles;
+  __asm__ __volatile__("rdcycle %0" : "=r"(cycles));
+  return cycles;
+}
+
+// An ebreak, which the kernel steps over
+static inline void breakpoint(void) {
+  __asm__ __volatile__("ebreak" ::: "memory");
+}
+
+static void report(const char *name, uint32_t value, const char *unit) {
+  printf("{\"bench\":\"%s\",\"value\":%u,\"unit\":\"%s\"}\n", name, value, unit);
+}
+
+// Microseconds since start (the time CSR runs at 10MHz)
+static uint32_t us_since(uint64_t start) {
+  return (uint32_t)(read_time() - start) / 10;
+}
+
+// Write one byte to every page of [heap, heap + size)
+static void touch_pages(uint8_t *heap, uint32_t size) {
+  for (uint32_t off = 0; off < size; off += PAGE_SIZE)
+    heap[off] = (uint8_t)off;
+}
+
+void main(void) {
+  // Null system call
+  uint64_t start = read_time();
+  uint32_t cycles = read_cycles();
+  for (int i = 0; i < 100000; i++)
+    getpid();
+  cycles = read_cycles() - cycles;
+  report("syscall_getpid", (uint32_t)(read_time() - start) / 1000, "ns");
+  report("syscall_getpid_cycles", cycles / 100000, "cycles");
+
+  // Full trap path: all 31 registers saved and restored
+  start = read_time();
+  cycles = read_cycles();
+  for (int i = 0; i < 100000; i++)
+    breakpoint();
+  cycles = read_cycles() - cycles;
+  report("trap_full_path", (uint32_t)(read_time() - start) / 1000, "ns");
+  report("trap_full_path_cycles", cycles / 100000, "cycles");
+
+  // Demand-zero faults: the first write to each page of a new heap
+  uint8_t *heap = sbrk(4 * MB);
+  start = read_time();
+  touch_pages(heap, 4 * MB);
+  uint32_t us = us_since(start);
+  report("page_fault", us * 1000 / (4 * MB / PAGE_SIZE), "ns");
+  report("page_faults_per_sec", (4 * MB / PAGE_SIZE) * 1000000u / (us + 1),
+         "faults/s");
+  sbrk(-4 * MB);
+
+  // Shrinking the heap unmaps its pages and flushes them in one batch
+  start = read_time();
+  for (int i = 0; i < 200; i++) {
+    heap = sbrk(64 * 1024);
+    touch_pages(heap, 64 * 1024);
+    sbrk(-64 * 1024);
+  }
+  report("heap_grow_touch_shrink_64k", us_since(start) / 200, "us");
+
+  // fork with every heap page present, copy-on-write and copied up front
+  // Either way the child's pages add up to the heap again, which is why
+  // kernel.ld sets aside more than twice the largest size.
+  static const uint32_t sizes[] = {1 * MB, 16 * MB, 48 * MB};
+  for (uint32_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    uint32_t size = sizes[i];
+    char name[48];
+    heap = sbrk(size);
+    touch_pages(heap, size);
+
+    start = read_time();
+    int child = fork();
+    if (child == 0) {
+      touch_pages(heap, size);
+      snprintf(name, sizeof(name), "fork_cow_write_all/%uMB", size / MB);
+      report(name, us_since(start), "us");
+      exit();
+    }
+    snprintf(name, sizeof(name), "fork_cow/%uMB", size / MB);
+    report(name, us_since(start), "us");
+    // The child's pages must be gone before the next fork
+    wait(child);
+
+    start = read_time();
+    child = fork_copy();
+    if (child == 0)
+      exit();
+    snprintf(name, sizeof(name), "fork_copy/%uMB", size / MB);
+    report(name, us_since(start), "us");
+    wait(child);
+
+    // Give the heap back before the next, larger one
+    sbrk(-(int)size);
+  }
+}
@@ -3,11 +3,12 @@
  * 
  * This file provides essential utility functions used throughout the kernel:
  * 1. I/O Operations
- *    - printf implementation for formatted output
- *    - putchar for basic character output
+ *    - vsnprintf/snprintf formatting into a caller buffer
+ *    - printf, which formats a message and writes it out in one piece
  * 
  * 2. Memory Operations
  *    - memcpy for memory copying
+ *    - memmove for copying between overlapping buffers
  *    - memset for memory initialization
  * 
  * 3. String Operations
@@ -24,94 +25,416 @@
 #include "common.h"
 
 // I/O Operations
-// Function prototype for putchar, which outputs a single character
-// This is the lowest level output function, used by printf
-void putchar(char c);
+// Output sink for printf, provided by the kernel (console ring) and by the
+// user library (write system call). Each printf hands over a whole message.
+void console_write(const char *s, size_t len);
 
 // I/O Operations
-// Custom implementation of printf function
-// Supports basic format specifiers: %s (strings), %d (integers), %x (hex)
-// Used for kernel debugging and status reporting
-void printf(const char *format, ...) {
-  var_list args; // Declare a variable list to handle the variable arguments
-  var_start(args, format); // Initialize the variable argument list
-
-  // Loop through each character in the format string
-  while (*format) {
-    if (*format == '%') { // Check for format specifier
-      format++;           // Move to the specifier character
-      switch (*format) {
-      case '\0':      // Handle end of string
-        putchar('%'); // Output a literal '%'
-        goto end;     // Exit the loop
-      case '%':       // Handle '%%' to output a single '%'
-        putchar('%');
-        break;
-      case 's': { // Handle string format specifier
-        const char *s = var_arg(args, const char *); // Get the string argument
-        while (*s) { // Output each character of the string
-          putchar(*s);
-          s++;
-        }
-        break;
-      }
-      case 'd': {                     // Handle integer format specifier
-        int val = var_arg(args, int); // Get the integer argument
-        if (val < 0) {                // Handle negative numbers
-          putchar('-');
-          val = -val;
-        }
-        int divisor = 1;
-        // Calculate the divisor to extract each digit
-        while (val / divisor >= 10)
-          divisor *= 10;
-        // Output each digit
-        while (divisor > 0) {
-          putchar('0' + val / divisor);
-          val %= divisor;
-          divisor /= 10;
-        }
-        break;
-      }
-      case 'x': {                     // Handle hexadecimal format specifier
-        int val = var_arg(args, int); // Get the integer argument
-        // Output each hex digit
-        for (int i = 7; i >= 0; i--) {
-          putchar("0123456789abcdef"[val >> (i * 4) & 0xF]);
-        }
+// Number conversion
+// Digits are produced backwards from the end of a scratch buffer. Decimal
+// conversion peels off two digits at a time through a lookup table; hex needs
+// only shifts and masks. Division by a constant compiles to a multiply, and
+// 64-bit values are split with 32-bit divisions (see div_10000) because rv32
+// has no 64-bit divide.
+static const char hex_digits[] = "0123456789abcdef";
+static const char digit_pairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536"
+    "37383940414243444546474849505152535455565758596061626364656667686970717273"
+    "7475767778798081828384858687888990919293949596979899";
+
+// Write the decimal digits of val so they end just before end
+static char *format_dec32(char *end, uint32_t val) {
+  while (val >= 100) {
+    uint32_t rem = val % 100;
+    val /= 100;
+    end -= 2;
+    end[0] = digit_pairs[rem * 2];
+    end[1] = digit_pairs[rem * 2 + 1];
+  }
+  if (val >= 10) {
+    end -= 2;
+    end[0] = digit_pairs[val * 2];
+    end[1] = digit_pairs[val * 2 + 1];
+  } else {
+    *--end = '0' + val;
+  }
+  return end;
+}
+
+// Divide *val by 10000 and return the remainder
+// Long division over 16-bit limbs: the running remainder stays below 10000,
+// so every step fits a 32-bit division.
+static uint32_t div_10000(uint64_t *val) {
+  uint32_t limbs[4] = {(uint32_t)(*val >> 48), (uint32_t)(*val >> 32) & 0xffff,
+                       (uint32_t)*val >> 16, (uint32_t)*val & 0xffff};
+  uint64_t quot = 0;
+  uint32_t rem = 0;
+  for (int i = 0; i < 4; i++) {
+    uint32_t cur = (rem << 16) | limbs[i];
+    rem = cur % 10000;
+    quot = (quot << 16) | (cur / 10000);
+  }
+  *val = quot;
+  return rem;
+}
+
+static char *format_dec64(char *end, uint64_t val) {
+  // Four digits (leading zeros included) per step until val fits 32 bits
+  while (val >> 32) {
+    uint32_t rem = div_10000(&val);
+    end -= 4;
+    end[0] = digit_pairs[rem / 100 * 2];
+    end[1] = digit_pairs[rem / 100 * 2 + 1];
+    end[2] = digit_pairs[rem % 100 * 2];
+    end[3] = digit_pairs[rem % 100 * 2 + 1];
+  }
+  return format_dec32(end, (uint32_t)val);
+}
+
+static char *format_hex(char *end, uint64_t val, bool upper) {
+  do {
+    char digit = hex_digits[val & 0xf];
+    *--end = upper && digit >= 'a' ? digit - 'a' + 'A' : digit;
+    val >>= 4;
+  } while (val);
+  return end;
+}
+
+// I/O Operations
+// Output buffer for vsnprintf
+// Characters past the end of the buffer are counted but dropped, so the
+// caller learns how long the full message would have been.
+struct format_out {
+  char *buf;
+  size_t size;
+  size_t len;
+};
+
+static void format_put(struct format_out *out, char c) {
+  if (out->len + 1 < out->size)
+    out->buf[out->len] = c;
+  out->len++;
+}
+
+static void format_repeat(struct format_out *out, char c, int count) {
+  while (count-- > 0)
+    format_put(out, c);
+}
+
+// I/O Operations
+// Format into buf, writing at most size bytes including the terminating NUL
+// Returns the length the complete message would have (like C's vsnprintf).
+// Conversions: %d %i %u %x %X %p %c %s %%, with an optional 'l' or 'll'
+// length modifier (ll for 64-bit values), a field width, and the '-' (left
+// justify) and '0' (zero pad) flags.
+int vsnprintf(char *buf, size_t size, const char *fmt, var_list args) {
+  struct format_out out = {buf, size, 0};
+
+  for (; *fmt; fmt++) {
+    if (*fmt != '%') {
+      format_put(&out, *fmt);
+      continue;
+    }
+
+    // Flags and width
+    fmt++;
+    bool left = false, zero = false;
+    for (;; fmt++) {
+      if (*fmt == '-')
+        left = true;
+      else if (*fmt == '0')
+        zero = true;
+      else
         break;
+    }
+    int width = 0;
+    while (*fmt >= '0' && *fmt <= '9')
+      width = width * 10 + (*fmt++ - '0');
+
+    // Length modifier: 'l' is 32 bits on rv32, 'll' selects 64 bits
+    bool wide = false;
+    if (*fmt == 'l') {
+      fmt++;
+      if (*fmt == 'l') {
+        wide = true;
+        fmt++;
       }
-      default: // Handle unknown specifiers
-        putchar(*format);
-        break;
+    }
+
+    char scratch[24];                     // Longest: 20 digits of a uint64_t
+    char *end = scratch + sizeof(scratch);
+    char *digits = end;
+    const char *prefix = "";
+    switch (*fmt) {
+    case '\0':
+      format_put(&out, '%');
+      goto done;
+    case '%':
+      format_put(&out, '%');
+      continue;
+    case 'c':
+      *--digits = (char)var_arg(args, int);
+      zero = false;
+      break;
+    case 's': {
+      const char *str = var_arg(args, const char *);
+      if (!str)
+        str = "(null)";
+      int len = 0;
+      while (str[len])
+        len++;
+      if (!left)
+        format_repeat(&out, ' ', width - len);
+      for (int i = 0; i < len; i++)
+        format_put(&out, str[i]);
+      if (left)
+        format_repeat(&out, ' ', width - len);
+      continue;
+    }
+    case 'd':
+    case 'i': {
+      // Negate in unsigned arithmetic so INT_MIN doesn't overflow
+      if (wide) {
+        long long val = var_arg(args, long long);
+        uint64_t mag = val < 0 ? 0 - (uint64_t)val : (uint64_t)val;
+        digits = format_dec64(end, mag);
+        if (val < 0)
+          prefix = "-";
+      } else {
+        int val = var_arg(args, int);
+        uint32_t mag = val < 0 ? 0 - (uint32_t)val : (uint32_t)val;
+        digits = format_dec32(end, mag);
+        if (val < 0)
+          prefix = "-";
       }
-    } else { // Output regular characters
-      putchar(*format);
+      break;
+    }
+    case 'u':
+      digits = wide ? format_dec64(end, var_arg(args, uint64_t))
+                    : format_dec32(end, var_arg(args, uint32_t));
+      break;
+    case 'x':
+    case 'X':
+      digits = format_hex(end, wide ? var_arg(args, uint64_t)
+                                    : var_arg(args, uint32_t), *fmt == 'X');
+      break;
+    case 'p':
+      // Pointers always show all 8 digits
+      digits = format_hex(end, (uint32_t)var_arg(args, void *), false);
+      while (end - digits < 8)
+        *--digits = '0';
+      prefix = "0x";
+      break;
+    default: // Unknown conversion: print it as is
+      format_put(&out, '%');
+      format_put(&out, *fmt);
+      continue;
     }
-    format++; // Move to the next character in the format string
+
+    // Pad the converted field to width
+    // Zero padding goes between the sign or prefix and the digits
+    int prefix_len = 0;
+    while (prefix[prefix_len])
+      prefix_len++;
+    int pad = width - prefix_len - (int)(end - digits);
+    if (!left && !zero)
+      format_repeat(&out, ' ', pad);
+    for (int i = 0; i < prefix_len; i++)
+      format_put(&out, prefix[i]);
+    if (!left && zero)
+      format_repeat(&out, '0', pad);
+    while (digits < end)
+      format_put(&out, *digits++);
+    if (left)
+      format_repeat(&out, ' ', pad);
   }
-end:
-  var_end(args); // Clean up the variable argument list
+
+done:
+  if (size > 0)
+    buf[out.len < size ? out.len : size - 1] = '\0';
+  return out.len;
+}
+
+// I/O Operations
+// Format into buf without printing anything, e.g. to build log records
+int snprintf(char *buf, size_t size, const char *fmt, ...) {
+  var_list args;
+  var_start(args, fmt);
+  int len = vsnprintf(buf, size, fmt, args);
+  var_end(args);
+  return len;
+}
+
+// I/O Operations
+// Formatted console output
+// The message is formatted on the stack and handed to the console in one
+// piece; anything beyond PRINTF_BUF_SIZE - 1 characters is cut off.
+void printf(const char *fmt, ...) {
+  char buf[PRINTF_BUF_SIZE];
+  var_list args;
+  var_start(args, fmt);
+  int len = vsnprintf(buf, sizeof(buf), fmt, args);
+  var_end(args);
+
+  if (len > PRINTF_BUF_SIZE - 1)
+    len = PRINTF_BUF_SIZE - 1;
+  console_write(buf, len);
 }
 
+// Memory Operations
+// Word type for the bulk loops below
+// may_alias lets word stores and loads touch memory of any declared type
+typedef uint32_t __attribute__((may_alias)) word_t;
+#define WORD_SIZE sizeof(word_t)
+#define WORD_MASK (WORD_SIZE - 1)
+
 // Memory Operations
 // Copy n bytes from src to dest
 // Used for memory management and data movement
+// Copies a byte head until dest is word aligned, then moves 32 bytes per loop
+// iteration with word loads/stores, and finishes with a byte tail. When src
+// and dest disagree on alignment each destination word is assembled from two
+// aligned source words. Copying forward is safe for overlapping buffers as
+// long as dest < src, which memmove relies on.
 void *memcpy(void *dest, const void *src, size_t n) {
   uint8_t *d = (uint8_t *)dest;
   const uint8_t *s = (const uint8_t *)src;
+
+  if (n >= 2 * WORD_SIZE) {
+    // Head: bring dest to a word boundary
+    while ((uint32_t)d & WORD_MASK) {
+      *d++ = *s++;
+      n--;
+    }
+
+    word_t *dw = (word_t *)d;
+    uint32_t shift = ((uint32_t)s & WORD_MASK) * 8;
+    if (shift == 0) {
+      // Both pointers aligned: unrolled word copy
+      const word_t *sw = (const word_t *)s;
+      while (n >= 8 * WORD_SIZE) {
+        word_t w0 = sw[0], w1 = sw[1], w2 = sw[2], w3 = sw[3];
+        word_t w4 = sw[4], w5 = sw[5], w6 = sw[6], w7 = sw[7];
+        dw[0] = w0;
+        dw[1] = w1;
+        dw[2] = w2;
+        dw[3] = w3;
+        dw[4] = w4;
+        dw[5] = w5;
+        dw[6] = w6;
+        dw[7] = w7;
+        sw += 8;
+        dw += 8;
+        n -= 8 * WORD_SIZE;
+      }
+      while (n >= WORD_SIZE) {
+        *dw++ = *sw++;
+        n -= WORD_SIZE;
+      }
+      s = (const uint8_t *)sw;
+    } else {
+      // Misaligned source: merge neighbouring aligned words (little endian)
+      // Aligned loads never cross a page, so reading the last partial word
+      // cannot fault even though it extends past the end of src
+      const word_t *sw = (const word_t *)((uint32_t)s & ~WORD_MASK);
+      uint32_t cur = *sw++;
+      while (n >= WORD_SIZE) {
+        uint32_t next = *sw++;
+        *dw++ = (cur >> shift) | (next << (32 - shift));
+        cur = next;
+        s += WORD_SIZE;
+        n -= WORD_SIZE;
+      }
+    }
+    d = (uint8_t *)dw;
+  }
+
+  // Tail: remaining bytes
   while (n--)
     *d++ = *s++;
 
   return dest;
 }
 
+// Memory Operations
+// Copy n bytes from src to dest where the buffers may overlap
+// Forward copies are safe when dest is below src; otherwise copy backwards,
+// word at a time when both ends share alignment
+void *memmove(void *dest, const void *src, size_t n) {
+  uint8_t *d = (uint8_t *)dest;
+  const uint8_t *s = (const uint8_t *)src;
+  if (d == s || n == 0)
+    return dest;
+  if (d < s || d >= s + n)
+    return memcpy(dest, src, n);
+
+  d += n;
+  s += n;
+  if ((((uint32_t)d ^ (uint32_t)s) & WORD_MASK) == 0) {
+    while (n && ((uint32_t)d & WORD_MASK)) {
+      *--d = *--s;
+      n--;
+    }
+
+    word_t *dw = (word_t *)d;
+    const word_t *sw = (const word_t *)s;
+    while (n >= 4 * WORD_SIZE) {
+      word_t w3 = sw[-1], w2 = sw[-2], w1 = sw[-3], w0 = sw[-4];
+      dw[-1] = w3;
+      dw[-2] = w2;
+      dw[-3] = w1;
+      dw[-4] = w0;
+      sw -= 4;
+      dw -= 4;
+      n -= 4 * WORD_SIZE;
+    }
+    while (n >= WORD_SIZE) {
+      *--dw = *--sw;
+      n -= WORD_SIZE;
+    }
+    d = (uint8_t *)dw;
+    s = (const uint8_t *)sw;
+  }
+
+  while (n--)
+    *--d = *--s;
+
+  return dest;
+}
+
 // Memory Operations
 // Set n bytes of memory starting at buf to value c
 // Used for memory initialization and zeroing
+// Fills a byte head up to a word boundary, then 32 bytes per loop iteration
+// with the byte replicated across a word, then a byte tail
 void *memset(void *buf, char c, size_t n) {
   uint8_t *p = (uint8_t *)buf;
-  while (n--) // Set each byte to the specified character
+  while (n && ((uint32_t)p & WORD_MASK)) {
+    *p++ = c;
+    n--;
+  }
+
+  word_t w = (uint8_t)c * 0x01010101u; // Byte replicated into every lane
+  word_t *pw = (word_t *)p;
+  while (n >= 8 * WORD_SIZE) {
+    pw[0] = w;
+    pw[1] = w;
+    pw[2] = w;
+    pw[3] = w;
+    pw[4] = w;
+    pw[5] = w;
+    pw[6] = w;
+    pw[7] = w;
+    pw += 8;
+    n -= 8 * WORD_SIZE;
+  }
+  while (n >= WORD_SIZE) {
+    *pw++ = w;
+    n -= WORD_SIZE;
+  }
+
+  p = (uint8_t *)pw;
+  while (n--) // Set each remaining byte to the specified character
     *p++ = c;
   return buf; // Return the pointer to the buffer
 }
@@ -143,3 +466,20 @@ int strcmp(const char *s1, const char *s2) {
 
   return *(unsigned char *)s1 - *(unsigned char *)s2;
 }
+
+// Arithmetic Operations
+// Divide a 64-bit value by a 32-bit one
+// rv32 has no 64-bit divide and nothing provides libgcc's __udivdi3, so this
+// is binary long division: one shift and compare per quotient bit.
+uint64_t div_u64(uint64_t val, uint32_t divisor) {
+  uint64_t quot = 0;
+  uint64_t rem = 0;
+  for (int bit = 63; bit >= 0; bit--) {
+    rem = (rem << 1) | ((val >> bit) & 1);
+    if (rem >= divisor) {
+      rem -= divisor;
+      quot |= 1ull << bit;
+    }
+  }
+  return quot;
+}
@@ -12,6 +12,7 @@
  *    - Page size (PAGE_SIZE)
  *    - Boolean constants
  *    - NULL pointer
+ *    - System call numbers
  * 
  * 3. Compiler Built-ins
  *    - Memory alignment functions
@@ -40,11 +41,33 @@ typedef uint32_t vaddr_t;           // Virtual address type
 #define false 0                     // Boolean false value
 #define NULL ((void *)0)            // Null pointer definition
 
+// System Call Numbers
+// Shared by the kernel and user programs; passed in a7
+#define SYS_PUTCHAR 1               // putchar(ch)
+#define SYS_GETPID 2                // getpid()
+#define SYS_YIELD 3                 // yield()
+#define SYS_EXIT 4                  // exit()
+#define SYS_SBRK 5                  // sbrk(increment)
+#define SYS_FORK 6                  // fork(), or fork_copy() with FORK_COPY
+#define SYS_READ 7                  // read(buf, len)
+#define SYS_WRITE 8                 // write(buf, len)
+#define SYS_SLEEP 9                 // sleep(ticks)
+#define SYS_WAIT 10                 // wait(pid)
+#define TICK_HZ 100                 // sleep() ticks per second
+#define FORK_COPY 1                 // SYS_FORK argument: copy every page now
+
+// User Address Space
+// Shared by the kernel and user programs
+#define USER_STACK_TOP 0x40000000   // User stacks grow down from here
+#define USER_STACK_SIZE (1024 * 1024) // Reserved (lazily backed) stack size
+
 // Compiler Built-ins
 // Memory alignment utilities
 #define align_up(value, align) __builtin_align_up(value, align)     // Align value up to boundary
 #define is_aligned(value, align) __builtin_is_aligned(value, align) // Check if value is aligned
 #define offsetof(type, member) __builtin_offsetof(type, member)     // Get offset of struct member
+#define container_of(ptr, type, member)                                        \
+  ((type *)((char *)(ptr) - offsetof(type, member)))        // Get struct from member pointer
 
 // Variable argument handling
 #define var_list __builtin_va_list   // Type for variable arguments
@@ -56,10 +79,18 @@ typedef uint32_t vaddr_t;           // Virtual address type
 // Memory Operations
 void *memset(void *buf, char c, size_t n);    // Set memory to value
 void *memcpy(void *dest, const void *src, size_t n);  // Copy memory
+void *memmove(void *dest, const void *src, size_t n); // Copy overlapping memory
 
 // String Operations
 char *strcpy(char *dest, const char *src);     // Copy string
 int strcmp(const char *s1, const char *s2);    // Compare strings
 
+// Arithmetic Operations
+uint64_t div_u64(uint64_t val, uint32_t divisor); // 64-bit by 32-bit division
+
 // I/O Operations
+#define PRINTF_BUF_SIZE 256                    // Longest message printf prints
+int vsnprintf(char *buf, size_t size, const char *fmt,
+              var_list args);                  // Format into a buffer
+int snprintf(char *buf, size_t size, const char *fmt, ...); // Same, variadic
 void printf(const char *fmt, ...);             // Formatted output
@@ -40,42 +40,747 @@
 extern char __bss[], __bss_end[], __stack_top[], __free_ram[], __free_ram_end[],
     __kernel_base[];
 
+// Embedded user program image (app.bin, linked in by run.sh)
+extern char _binary_app_bin_start[], _binary_app_bin_size[];
+
 // Forward declarations of functions in order of use
 __attribute__((naked)) __attribute__((aligned(4))) void kernel_entry(void);
 __attribute__((section(".text.boot"))) __attribute__((naked)) void boot(void);
+__attribute__((naked)) void secondary_boot(void);
 __attribute__((naked)) void switch_context(uint32_t *prev_sp, uint32_t *next_sp);
-void kernel_main(void);
-void handle_trap(void);
+void handle_trap(struct trap_frame *f);
+void handle_timer_interrupt(void);
+void handle_ipi(void);
+static void timer_program(void);
+static void kick_idle_hart(struct cpu *cpu);
 void yeild(void);
-void proc_a_entry(void);
-void proc_b_entry(void);
+__attribute__((noreturn)) void process_exit(void);
+void handle_syscall(struct trap_frame *f);
+bool handle_page_fault(uint32_t scause, vaddr_t addr);
+__attribute__((naked)) void fork_return(void);
+
+// Per-hart state, indexed by hart id
+struct cpu cpus[MAX_HARTS];
+uint32_t nr_cpus;                       // Harts running the scheduler
+uint32_t boot_hartid;                   // Hart that ran kernel_main
 
 // Process management variables
-struct process *curr_proc, *idle_proc;  // Current and idle processes
-struct process procs[PROCS_MAX];        // Array of all processes
-struct process *proc_a, *proc_b;        // User processes
+// proc_lock protects proc_list, zombie_list, exit_wait and next_pid
+struct spinlock proc_lock;
+struct list_node proc_list;             // Every live process, linked by all_node
+struct kmem_cache proc_cache;           // Slab cache the PCBs come from
+struct list_node zombie_list;           // Exited processes waiting to be freed
+struct list_node exit_wait;             // Processes in wait(), woken by every reap
+int next_pid = 1;                       // Next pid to hand out
+struct kmem_cache vma_cache;            // Slab cache for struct vma
+struct kmem_cache kmalloc_caches[KMALLOC_CLASSES]; // kmalloc size classes
+uint32_t page_faults_total;             // Demand-paging faults served so far
+
+// Scheduler timing
+uint32_t sched_slice;                          // Time slice length in timer ticks
+struct latency_hist sched_wait;                 // Ready-to-run waits
+struct latency_hist sleep_late;                 // Sleepers' wakeups past their time
+uint64_t boot_time;                            // time CSR when kernel_main started
+uint32_t idle_harts;                           // Harts waiting in wfi, by hart id
+
+// Timer wheel
+// jiffies counts timer wheel ticks (TICK_HZ per second); the name keeps them
+// apart from the time CSR's ticks. Level l slot s holds the timers whose
+// expiry is less than 64^(l+1) jiffies away and has s in its l'th group of
+// TIMER_LEVEL_BITS bits.
+struct spinlock timer_lock;                    // Protects the wheel and jiffies
+struct list_node timer_wheel[TIMER_LEVELS][TIMER_LEVEL_SIZE];
+uint32_t jiffies;                              // Jiffies processed so far
+uint64_t jiffy_next;                           // time CSR value of the next jiffy
+uint32_t timers_pending;                       // Timers on the wheel
+uint32_t timer_next;                           // First jiffy with work, if any pending
+struct latency_hist timer_jitter;              // Expiries past their jiffy
+uint32_t timers_armed;                         // timer_arm calls
+uint32_t timers_cancelled;                     // timer_cancel calls that stopped one
+uint32_t timers_expired;                       // Callbacks run
+
+// Console output ring
+// console_head and console_tail run freely; masking gives the buffer index
+// console_lock protects both rings, the UART and uart_rx_wait
+struct spinlock console_lock;
+char console_buf[CONSOLE_BUF_SIZE];
+uint32_t console_head;                  // Next byte to fill
+uint32_t console_tail;                  // Next byte to write out
+bool console_dbcn;                      // Firmware has the debug console extension
+uint32_t console_chars;                 // Characters printed
+uint32_t console_sbi_calls;             // Firmware calls spent printing them
+bool uart_ready;                        // Console output goes to the UART
+
+// UART receive ring, filled by the interrupt handler
+char uart_rx_buf[UART_RX_BUF_SIZE];
+uint32_t uart_rx_head;                  // Next byte to fill
+uint32_t uart_rx_tail;                  // Next byte to read
+uint32_t uart_rx_dropped;               // Bytes lost to a full ring
+struct list_node uart_rx_wait;          // Processes blocked in console_read
+uint32_t console_requests;              // CONSOLE_REQ_* bits the idle loop acts on
+
+// Kernel address space
+// First-level table holding only the kernel identity mapping
+// Process page tables start as a copy of it
+uint32_t *kernel_page_table;
+
+// Address space identifiers
+uint32_t asid_max;                      // Largest ASID satp accepts (0: no ASIDs)
+uint32_t asid_next;                     // Next unused ASID in this generation
+uint32_t asid_generation;               // Bumped whenever the ASIDs are recycled
+struct spinlock asid_lock;              // Protects the three above
+uint32_t plic_context;                  // PLIC context device interrupts go to
+
+// TLB shootdown statistics
+uint32_t tlb_batches;                   // Batches flushed
+uint32_t tlb_remote_fences;             // SBI remote fences sent
+uint32_t tlb_harts_skipped;             // Remote harts left to flush lazily
+uint32_t tlb_lazy_flushes;              // ASID flushes done when switching in
+uint32_t tlb_flush_ticks;               // Time spent in tlb_batch_flush
+uint32_t ipis_sent;                     // Reschedule IPIs sent
+
+// Per-hart trace rings, see trace()
+struct trace_ring trace_rings[MAX_HARTS];
+
+// Tracing
+// Print every online hart's trace ring, oldest event first, for trace.py
+// The header gives the full time CSR, so the script can tell which 2^32-tick
+// period the events' low words belong to. Events recorded while this runs
+// can overwrite ones not yet printed on a busy hart.
+void trace_dump(void) {
+  printf("trace: now=%llx entries=%u\n", read_time(), TRACE_ENTRIES);
+  for (uint32_t hartid = 0; hartid < MAX_HARTS; hartid++) {
+    if (!cpus[hartid].online)
+      continue;
+    struct trace_ring *ring = &trace_rings[hartid];
+    uint32_t head = ring->head;
+    uint32_t first = head > TRACE_ENTRIES ? head - TRACE_ENTRIES : 0;
+    for (uint32_t i = first; i != head; i++) {
+      struct trace_event *event = &ring->events[i & (TRACE_ENTRIES - 1)];
+      printf("T %u %x %u %x %x\n", hartid, event->time, event->type, event->a,
+             event->b);
+    }
+  }
+  printf("trace: end\n");
+}
+
+// Synchronization
+// Interrupt masking that nests across spinlocks
+// The first lock a hart takes masks interrupts and remembers whether they were
+// on; releasing the last one restores that.
+static void push_off(void) {
+  uint32_t enabled = irq_save();
+  struct cpu *cpu = this_cpu();
+  if (cpu->irq_depth++ == 0)
+    cpu->irq_enabled = enabled;
+}
+
+static void pop_off(void) {
+  struct cpu *cpu = this_cpu();
+  if (cpu->irq_depth == 0)
+    PANIC("pop_off without push_off");
+  if (--cpu->irq_depth == 0)
+    irq_restore(cpu->irq_enabled);
+}
+
+// Synchronization
+// Lock statistics
+// Every lock registers its stats when it is set up so lock_report can find it.
+// Holds are timed with the low half of the time CSR, which is all a hold
+// needs and costs a single read.
+struct lock_stats *lock_registry[LOCK_REGISTRY_SIZE];
+uint32_t lock_registry_count;
+
+static void lock_stats_init(struct lock_stats *stats, const char *name) {
+  memset(stats, 0, sizeof(*stats));
+  stats->name = name;
+  uint32_t slot = __atomic_fetch_add(&lock_registry_count, 1, __ATOMIC_RELAXED);
+  if (slot < LOCK_REGISTRY_SIZE)
+    lock_registry[slot] = stats;
+}
+
+static inline uint32_t lock_clock(void) {
+  uint32_t now;
+  __asm__ __volatile__("rdtime %0" : "=r"(now));
+  return now;
+}
+
+static inline void lock_stats_acquired(struct lock_stats *stats,
+                                       bool contended) {
+  stats->acquired++;
+  stats->contended += contended;
+  stats->locked_at = lock_clock();
+}
+
+static inline void lock_stats_released(struct lock_stats *stats) {
+  uint32_t held = lock_clock() - stats->locked_at;
+  stats->hold_ticks += held;
+  if (held > stats->hold_max)
+    stats->hold_max = held;
+}
+
+// Print acquisitions, contention and hold times of every lock used so far
+void lock_report(void) {
+  uint32_t ns_per_tick = 1000000000 / TIMEBASE_HZ;
+  uint32_t count = lock_registry_count < LOCK_REGISTRY_SIZE ? lock_registry_count
+                                                             : LOCK_REGISTRY_SIZE;
+  for (uint32_t i = 0; i < count; i++) {
+    struct lock_stats *stats = lock_registry[i];
+    if (!stats->acquired)
+      continue;
+    printf("%-13s %8u acq %3u%% contended, hold avg %uns max %uns\n",
+           stats->name, stats->acquired,
+           stats->contended * 100 / stats->acquired,
+           stats->hold_ticks / stats->acquired * ns_per_tick,
+           stats->hold_max * ns_per_tick);
+  }
+}
+
+void spin_init(struct spinlock *lock, const char *name) {
+  lock->locked = 0;
+  lock_stats_init(&lock->stats, name);
+}
+
+// Synchronization
+// Take and drop a spinlock without touching the interrupt state
+// amoswap.w.aq atomically sets the word and orders everything after it behind
+// the acquisition. While the lock is taken, waiters spin on plain loads so
+// they don't keep pulling the cache line away from the holder.
+static void spin_acquire(struct spinlock *lock) {
+  bool contended = false;
+  for (;;) {
+    uint32_t old;
+    __asm__ __volatile__("amoswap.w.aq %0, %1, (%2)"
+                         : "=r"(old)
+                         : "r"(1), "r"(&lock->locked)
+                         : "memory");
+    if (!old)
+      break;
+    contended = true;
+    while (__atomic_load_n(&lock->locked, __ATOMIC_RELAXED))
+      ;
+  }
+  lock_stats_acquired(&lock->stats, contended);
+}
+
+// amoswap.w.rl publishes every write made while holding the lock
+static void spin_release(struct spinlock *lock) {
+  lock_stats_released(&lock->stats);
+  __asm__ __volatile__("amoswap.w.rl zero, zero, (%0)" ::"r"(&lock->locked)
+                       : "memory");
+}
+
+// Synchronization
+// Acquire and release a spinlock
+// Interrupt masking nests through push_off, so any number of locks can be
+// held at once and released in any order.
+void spin_lock(struct spinlock *lock) {
+  push_off();
+  spin_acquire(lock);
+}
+
+void spin_unlock(struct spinlock *lock) {
+  spin_release(lock);
+  pop_off();
+}
+
+// Synchronization
+// Acquire a spinlock and hand the caller the interrupt state to restore
+// For a lock taken and released within one function. Releases must come in
+// reverse order of acquisition; they still count towards irq_depth, so yeild
+// catches a process switching away with one held.
+uint32_t spin_lock_irqsave(struct spinlock *lock) {
+  uint32_t flags = irq_save();
+  this_cpu()->irq_depth++;
+  spin_acquire(lock);
+  return flags;
+}
+
+void spin_unlock_irqrestore(struct spinlock *lock, uint32_t flags) {
+  spin_release(lock);
+  this_cpu()->irq_depth--;
+  irq_restore(flags);
+}
+
+// Synchronization
+// Ticket locks
+// amoadd.w draws the ticket; the holder serves the next one by bumping owner
+// with a release store, and the waiter holding that ticket sees it with an
+// acquire load. Only the holder writes owner, so the bump needs no atomic
+// read-modify-write.
+void ticket_init(struct ticketlock *lock, const char *name) {
+  lock->next = 0;
+  lock->owner = 0;
+  lock_stats_init(&lock->stats, name);
+}
+
+void ticket_lock(struct ticketlock *lock) {
+  push_off();
+  uint32_t ticket;
+  __asm__ __volatile__("amoadd.w %0, %1, (%2)"
+                       : "=r"(ticket)
+                       : "r"(1), "r"(&lock->next)
+                       : "memory");
+  bool contended = false;
+  while (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket)
+    contended = true;
+  lock_stats_acquired(&lock->stats, contended);
+}
+
+void ticket_unlock(struct ticketlock *lock) {
+  lock_stats_released(&lock->stats);
+  __atomic_store_n(&lock->owner, lock->owner + 1, __ATOMIC_RELEASE);
+  pop_off();
+}
 
 // Memory Management
+// Buddy allocator state
+// Every page between __free_ram and __free_ram_end is described by a struct page.
+// Free blocks are kept in one circular list per order, where a block of order k
+// covers 2^k physically contiguous pages aligned to 2^k pages.
+// page_lock protects the free lists and the zero pool. It is a ticket lock:
+// every idle hart refills the zero pool, and first come, first served keeps
+// them from starving a process that needs a page.
+struct ticketlock page_lock;
+struct page *page_map;                        // Descriptors for all managed pages
+uint32_t page_base_pfn;                       // Page frame number of page_map[0]
+uint32_t page_count;                          // Number of managed pages
+uint32_t free_page_count;                     // Pages currently sitting in free lists
+struct page free_lists[PAGE_ORDER_MAX + 1];   // List heads, one per block order
+
+// Convert between page descriptors and physical addresses
+static inline paddr_t page_to_paddr(struct page *pg) {
+  return (page_base_pfn + (uint32_t)(pg - page_map)) * PAGE_SIZE;
+}
+
+static inline struct page *paddr_to_page(paddr_t paddr) {
+  return &page_map[paddr / PAGE_SIZE - page_base_pfn];
+}
+
+// Free list helpers
+static void free_list_push(uint32_t order, struct page *pg) {
+  struct page *head = &free_lists[order];
+  pg->order = order;
+  pg->flags = PG_FREE;
+  pg->next = head->next;
+  pg->prev = head;
+  head->next->prev = pg;
+  head->next = pg;
+  free_page_count += 1u << order;
+}
+
+static void free_list_remove(struct page *pg) {
+  pg->prev->next = pg->next;
+  pg->next->prev = pg->prev;
+  pg->next = pg->prev = NULL;
+  pg->flags = 0;
+  free_page_count -= 1u << pg->order;
+}
+
+// Smallest order whose block holds n pages
+static uint32_t pages_to_order(uint32_t n) {
+  uint32_t order = 0;
+  while ((1u << order) < n)
+    order++;
+
+  if (order > PAGE_ORDER_MAX)
+    PANIC("allocation of %d pages exceeds the largest block", n);
+  return order;
+}
+
+// Set up the buddy allocator over __free_ram..__free_ram_end
+// The page descriptors themselves are carved out of the start of the region,
+// the remaining pages are seeded into the free lists as the largest naturally
+// aligned blocks that fit.
+void init_pages(void) {
+  for (uint32_t order = 0; order <= PAGE_ORDER_MAX; order++)
+    free_lists[order].next = free_lists[order].prev = &free_lists[order];
+
+  uint32_t total = ((paddr_t)__free_ram_end - (paddr_t)__free_ram) / PAGE_SIZE;
+  uint32_t map_pages =
+      align_up(total * sizeof(struct page), PAGE_SIZE) / PAGE_SIZE;
+
+  page_map = (struct page *)__free_ram;
+  page_base_pfn = (paddr_t)__free_ram / PAGE_SIZE + map_pages;
+  page_count = total - map_pages;
+  memset(page_map, 0, page_count * sizeof(struct page));
+
+  uint32_t pfn = page_base_pfn;
+  uint32_t end_pfn = page_base_pfn + page_count;
+  while (pfn < end_pfn) {
+    uint32_t order = PAGE_ORDER_MAX;
+    while ((pfn & ((1u << order) - 1)) || pfn + (1u << order) > end_pfn)
+      order--;
+    free_list_push(order, &page_map[pfn - page_base_pfn]);
+    pfn += 1u << order;
+  }
+}
+
+// Take a block of the requested order, splitting a larger block if needed
+// Returns NULL when no block is large enough
+static struct page *buddy_alloc(uint32_t order) {
+  uint32_t k = order;
+  while (k <= PAGE_ORDER_MAX && free_lists[k].next == &free_lists[k])
+    k++;
+  if (k > PAGE_ORDER_MAX)
+    return NULL;
+
+  struct page *pg = free_lists[k].next;
+  free_list_remove(pg);
+
+  // Return the upper halves to the free lists until the block fits
+  while (k > order) {
+    k--;
+    free_list_push(k, pg + (1u << k));
+  }
+  pg->order = order;
+  return pg;
+}
+
+// Give a block back, merging it with its buddy for as long as the buddy is free
+static void buddy_free(struct page *pg, uint32_t order) {
+  uint32_t pfn = page_base_pfn + (uint32_t)(pg - page_map);
+  while (order < PAGE_ORDER_MAX) {
+    uint32_t buddy_pfn = pfn ^ (1u << order);
+    if (buddy_pfn < page_base_pfn || buddy_pfn >= page_base_pfn + page_count)
+      break;
+
+    struct page *buddy = &page_map[buddy_pfn - page_base_pfn];
+    if (!(buddy->flags & PG_FREE) || buddy->order != order)
+      break;
+
+    free_list_remove(buddy);
+    pfn &= ~(1u << order);
+    order++;
+  }
+  free_list_push(order, &page_map[pfn - page_base_pfn]);
+}
+
+// Whether the page at pfn lies in a block sitting in the free lists
+// Only the first page of a free block is marked PG_FREE, so a page that has
+// merged into a larger block is found by checking the start of every block
+// that could hold it, smallest first.
+static bool page_is_free(uint32_t pfn) {
+  for (uint32_t order = 0; order <= PAGE_ORDER_MAX; order++) {
+    uint32_t head_pfn = pfn & ~((1u << order) - 1);
+    if (head_pfn < page_base_pfn)
+      break;
+    struct page *head = &page_map[head_pfn - page_base_pfn];
+    if ((head->flags & PG_FREE) && head->order >= order)
+      return true;
+  }
+  return false;
+}
+
+// Pre-zeroed page pool
+// The idle process zeroes single pages ahead of time and parks them here,
+// so the common alloc_pages(1) path (page tables, stacks) skips the memset.
+struct page *zero_pool;                       // Stack of zeroed pages, linked via next
+uint32_t zero_pool_count;                     // Pages currently in the pool
+uint32_t zero_pool_filling;                   // Pages being zeroed for it
+uint32_t zero_pool_hits;                      // Allocations served from the pool
+uint32_t zero_pool_misses;                    // Single pages zeroed synchronously
+
+// Top up the pool to ZERO_POOL_TARGET pages
+// Called from the idle loop, never from an allocation path. Pages are zeroed
+// outside page_lock; idle harts refilling at the same time may overshoot the
+// target by a page or two.
+void zero_pool_refill(void) {
+  while (zero_pool_count < ZERO_POOL_TARGET) {
+    ticket_lock(&page_lock);
+    struct page *pg = buddy_alloc(0);
+    if (pg)
+      zero_pool_filling++;
+    ticket_unlock(&page_lock);
+    if (!pg)
+      break;
+
+    memset((void *)page_to_paddr(pg), 0, PAGE_SIZE);
+    ticket_lock(&page_lock);
+    pg->next = zero_pool;
+    zero_pool = pg;
+    zero_pool_count++;
+    zero_pool_filling--;
+    ticket_unlock(&page_lock);
+  }
+}
+
+// Return every pooled page to the buddy allocator
+// Used when a larger allocation fails because the pool holds the memory
+static void zero_pool_drain(void) {
+  while (zero_pool) {
+    struct page *pg = zero_pool;
+    zero_pool = pg->next;
+    pg->next = NULL;
+    buddy_free(pg, 0);
+  }
+  zero_pool_count = 0;
+}
+
+// Print the pool's depth and how often single-page allocations found it
+// stocked
+void zero_pool_report(void) {
+  ticket_lock(&page_lock);
+  uint32_t count = zero_pool_count;
+  uint32_t hits = zero_pool_hits, misses = zero_pool_misses;
+  ticket_unlock(&page_lock);
+  uint32_t total = hits + misses;
+  printf("zero pool: %u/%u pages, %u hits, %u misses, %u%% hit\n", count,
+         ZERO_POOL_TARGET, hits, misses, total ? hits * 100 / total : 0);
+}
+
 // Allocates n pages of physical memory
 // Returns the physical address of the first page
-// Pages are aligned to PAGE_SIZE (4KB) boundary
+// Pages are aligned to PAGE_SIZE (4KB) boundary and zero-filled
 // This is the core memory allocation function used by both kernel and processes
 paddr_t alloc_pages(uint32_t n) {
-  // Keep track of the next available physical address
-  static paddr_t next_paddr = (paddr_t)__free_ram;
-  paddr_t paddr = next_paddr;
-  next_paddr += n * PAGE_SIZE;
+  uint32_t order = pages_to_order(n);
+  ticket_lock(&page_lock);
+
+  // Fast path: hand out a page the idle process has already zeroed
+  if (n == 1 && zero_pool) {
+    struct page *pg = zero_pool;
+    zero_pool = pg->next;
+    pg->next = NULL;
+    zero_pool_count--;
+    zero_pool_hits++;
+    ticket_unlock(&page_lock);
+    pg->refcount = 1;
+    trace(TRACE_ALLOC, page_to_paddr(pg), n);
+    return page_to_paddr(pg);
+  }
 
-  // Check if we've exceeded available memory
-  if (next_paddr > (paddr_t)__free_ram_end) {
+  struct page *pg = buddy_alloc(order);
+  if (!pg && zero_pool) {
+    zero_pool_drain();
+    pg = buddy_alloc(order);
+  }
+  if (!pg) {
     PANIC("out of memory for execution");
   }
+  // Only single pages could have come from the pool
+  if (n == 1)
+    zero_pool_misses++;
+  ticket_unlock(&page_lock);
 
   // Zero out the allocated pages
+  pg->refcount = 1;
+  paddr_t paddr = page_to_paddr(pg);
   memset((void *)paddr, 0, n * PAGE_SIZE);
+  trace(TRACE_ALLOC, paddr, n);
   return paddr;
 }
 
+// Releases n pages previously returned by alloc_pages(n)
+void free_pages(paddr_t paddr, uint32_t n) {
+  uint32_t pfn = paddr / PAGE_SIZE;
+  if (!is_aligned(paddr, PAGE_SIZE) || pfn < page_base_pfn ||
+      pfn >= page_base_pfn + page_count)
+    PANIC("free_pages: bad paddr %x", paddr);
+
+  struct page *pg = paddr_to_page(paddr);
+  uint32_t order = pages_to_order(n);
+  ticket_lock(&page_lock);
+  if (page_is_free(pfn) || pg->order != order)
+    PANIC("free_pages: double free or size mismatch at %x", paddr);
+
+  buddy_free(pg, order);
+  ticket_unlock(&page_lock);
+  trace(TRACE_FREE, paddr, n);
+}
+
+// Memory Management
+// Page reference counts
+// alloc_pages hands out a page with one reference. User pages shared between
+// address spaces (copy-on-write after fork) take extra references, and the
+// page is freed when the last mapping drops it. The sharers may run on
+// different harts, so the count is updated with atomic adds (amoadd.w).
+void page_get(paddr_t paddr) {
+  __atomic_fetch_add(&paddr_to_page(paddr)->refcount, 1, __ATOMIC_RELAXED);
+}
+
+void page_put(paddr_t paddr) {
+  struct page *pg = paddr_to_page(paddr);
+  uint32_t old = __atomic_fetch_sub(&pg->refcount, 1, __ATOMIC_ACQ_REL);
+  if (old == 0)
+    PANIC("page_put: page %x has no references", paddr);
+  if (old == 1)
+    free_pages(paddr, 1);
+}
+
+// Memory Management
+// Slab allocator for fixed-size kernel objects
+// Each slab is one page cut into equal objects. Free objects are chained
+// through a link word, and the slab's page descriptor records the owning
+// cache, the free chain and how many objects are in use. Slabs with at least
+// one free object sit on the cache's partial list; full slabs are unlinked
+// until an object comes back.
+// A cache may have a constructor, which runs once for every object when its
+// slab is carved. Objects must be freed in their constructed state, so the
+// link word of such a cache lives past the end of the object instead of in
+// its first word.
+void kmem_cache_init(struct kmem_cache *cache, const char *name,
+                     uint32_t obj_size, void (*ctor)(void *obj)) {
+  cache->name = name;
+  cache->ctor = ctor;
+  obj_size = align_up(obj_size, sizeof(void *));
+  cache->free_offset = ctor ? obj_size : 0;
+  cache->obj_size = ctor ? obj_size + sizeof(void *) : obj_size;
+  cache->objs_per_slab = PAGE_SIZE / cache->obj_size;
+  if (cache->objs_per_slab == 0)
+    PANIC("%s: objects of %d bytes do not fit a slab", name, obj_size);
+  cache->partial.next = cache->partial.prev = &cache->partial;
+  cache->nr_slabs = 0;
+  cache->nr_active = 0;
+  spin_init(&cache->lock, name);
+}
+
+// Link word chaining a free object to the next one
+static inline void **slab_link(struct kmem_cache *cache, void *obj) {
+  return (void **)((uint8_t *)obj + cache->free_offset);
+}
+
+// Carve a fresh page into objects and put it on the partial list
+static struct page *kmem_cache_grow(struct kmem_cache *cache) {
+  paddr_t paddr = alloc_pages(1);
+  struct page *pg = paddr_to_page(paddr);
+  pg->slab_cache = cache;
+  pg->slab_inuse = 0;
+  pg->slab_free = NULL;
+  for (uint32_t i = cache->objs_per_slab; i > 0; i--) {
+    void *obj = (void *)(paddr + (i - 1) * cache->obj_size);
+    if (cache->ctor)
+      cache->ctor(obj);
+    *slab_link(cache, obj) = pg->slab_free;
+    pg->slab_free = obj;
+  }
+
+  pg->next = cache->partial.next;
+  pg->prev = &cache->partial;
+  cache->partial.next->prev = pg;
+  cache->partial.next = pg;
+  cache->nr_slabs++;
+  return pg;
+}
+
+// Allocate one object
+// Its contents are undefined, or constructed if the cache has a constructor
+void *kmem_cache_alloc(struct kmem_cache *cache) {
+  spin_lock(&cache->lock);
+  struct page *pg = cache->partial.next;
+  if (pg == &cache->partial)
+    pg = kmem_cache_grow(cache);
+
+  void *obj = pg->slab_free;
+  pg->slab_free = *slab_link(cache, obj);
+  pg->slab_inuse++;
+  cache->nr_active++;
+
+  // Slab is now full: take it off the partial list
+  if (!pg->slab_free) {
+    pg->prev->next = pg->next;
+    pg->next->prev = pg->prev;
+    pg->next = pg->prev = NULL;
+  }
+  spin_unlock(&cache->lock);
+  return obj;
+}
+
+// Return an object to its slab
+// An emptied slab goes back to the page allocator unless it is the only
+// partial slab left, which is kept to absorb alloc/free ping-pong
+void kmem_cache_free(struct kmem_cache *cache, void *obj) {
+  struct page *pg = paddr_to_page((paddr_t)obj & ~(PAGE_SIZE - 1));
+  if (pg->slab_cache != cache)
+    PANIC("%s: freeing foreign object %x", cache->name, obj);
+
+  spin_lock(&cache->lock);
+  bool was_full = pg->slab_free == NULL;
+  *slab_link(cache, obj) = pg->slab_free;
+  pg->slab_free = obj;
+  pg->slab_inuse--;
+  cache->nr_active--;
+
+  if (was_full) {
+    pg->next = cache->partial.next;
+    pg->prev = &cache->partial;
+    cache->partial.next->prev = pg;
+    cache->partial.next = pg;
+  }
+
+  bool only_slab = cache->partial.next == pg && pg->next == &cache->partial;
+  if (pg->slab_inuse == 0 && !only_slab) {
+    pg->prev->next = pg->next;
+    pg->next->prev = pg->prev;
+    pg->next = pg->prev = NULL;
+    pg->slab_cache = NULL;
+    cache->nr_slabs--;
+    free_pages(page_to_paddr(pg), 1);
+  }
+  spin_unlock(&cache->lock);
+}
+
+// Memory Management
+// General-purpose kernel heap
+// Requests up to KMALLOC_MAX bytes are served from one slab cache per power
+// of two size class, starting at KMALLOC_MIN. Larger ones get whole pages
+// straight from the page allocator. kfree tells the two apart by the page
+// descriptor: slab pages record their cache.
+static uint32_t kmalloc_class(size_t size) {
+  uint32_t class = 0;
+  while ((KMALLOC_MIN << class) < size)
+    class++;
+  return class;
+}
+
+void kmalloc_init(void) {
+  static const char *names[KMALLOC_CLASSES] = {
+      "kmalloc-16",  "kmalloc-32",  "kmalloc-64",   "kmalloc-128",
+      "kmalloc-256", "kmalloc-512", "kmalloc-1024", "kmalloc-2048"};
+  for (uint32_t class = 0; class < KMALLOC_CLASSES; class++)
+    kmem_cache_init(&kmalloc_caches[class], names[class], KMALLOC_MIN << class,
+                    NULL);
+}
+
+// Allocate size bytes; the memory is not cleared
+void *kmalloc(size_t size) {
+  if (size == 0)
+    return NULL;
+  if (size > KMALLOC_MAX) {
+    paddr_t paddr = alloc_pages(align_up(size, PAGE_SIZE) / PAGE_SIZE);
+    paddr_to_page(paddr)->slab_cache = NULL;
+    return (void *)paddr;
+  }
+  return kmem_cache_alloc(&kmalloc_caches[kmalloc_class(size)]);
+}
+
+// Release memory returned by kmalloc; kfree(NULL) does nothing
+void kfree(void *ptr) {
+  if (!ptr)
+    return;
+
+  struct page *pg = paddr_to_page((paddr_t)ptr & ~(PAGE_SIZE - 1));
+  if (pg->slab_cache)
+    kmem_cache_free(pg->slab_cache, ptr);
+  else
+    free_pages((paddr_t)ptr, 1u << pg->order);
+}
+
+// Print how well the size classes use their slabs
+// Used bytes are whole objects handed out; the rest of each slab page is free
+// objects or the unusable tail of the page.
+void kmalloc_report(void) {
+  for (uint32_t class = 0; class < KMALLOC_CLASSES; class++) {
+    struct kmem_cache *cache = &kmalloc_caches[class];
+    if (!cache->nr_slabs)
+      continue;
+    uint32_t used = cache->nr_active * cache->obj_size;
+    uint32_t total = cache->nr_slabs * PAGE_SIZE;
+    printf("%-13s %6u objs %4u slabs %3u%% used\n", cache->name,
+           cache->nr_active, cache->nr_slabs, used * 100 / total);
+  }
+}
+
 // System Interface
 // Makes a call to the SBI (Supervisor Binary Interface)
 // This is used for low-level hardware operations like console output
@@ -101,19 +806,270 @@ struct ret_sbi call_sbi(long arg0, long arg1, long arg2, long arg3, long arg4,
   return (struct ret_sbi){.err = a0, .val = a1}; // Return the result
 }
 
-// Output a single character using SBI console
+// Console
+// Check for the SBI debug console extension
+// Without it every character needs its own legacy putchar call.
+void console_init(void) {
+  struct ret_sbi ret =
+      call_sbi(SBI_EXT_DBCN, 0, 0, 0, 0, 0, SBI_BASE_PROBE_EXT, SBI_EXT_BASE);
+  console_dbcn = ret.err == 0 && ret.val != 0;
+}
+
+// Console
+// Move queued output into the UART's transmit FIFO
+// THRE means the whole FIFO is empty, so up to UART_FIFO_SIZE bytes fit. The
+// transmit interrupt stays enabled while bytes are left in the ring.
+// Like everything touching the rings below, runs under console_lock.
+static void uart_tx_fill(void) {
+  if (!(mmio_read8(UART_BASE + UART_LSR) & UART_LSR_THRE))
+    return;
+
+  for (int i = 0; i < UART_FIFO_SIZE && console_tail != console_head; i++)
+    mmio_write8(UART_BASE + UART_THR,
+                console_buf[console_tail++ & (CONSOLE_BUF_SIZE - 1)]);
+  mmio_write8(UART_BASE + UART_IER,
+              UART_IER_RDI | (console_tail != console_head ? UART_IER_THRI : 0));
+}
+
+// Console
+// Resolve CONSOLE_DEFAULT to the backend output currently goes through
+static uint32_t console_backend(uint32_t backend) {
+  if (backend != CONSOLE_DEFAULT)
+    return backend;
+  return uart_ready ? CONSOLE_UART : console_dbcn ? CONSOLE_DBCN : CONSOLE_LEGACY;
+}
+
+// Console
+// Hand everything queued in console_buf to the firmware or the UART and wait
+// until it has been accepted
+// DBCN takes a physical buffer; the kernel is identity mapped, so the ring
+// itself is passed, one contiguous run at a time. The firmware may accept
+// fewer bytes than asked, in which case the rest is retried.
+static void console_flush_locked(uint32_t backend) {
+  backend = console_backend(backend);
+  while (console_tail != console_head) {
+    if (backend == CONSOLE_UART) {
+      uart_tx_fill();
+      continue;
+    }
+
+    uint32_t start = console_tail & (CONSOLE_BUF_SIZE - 1);
+    uint32_t len = console_head - console_tail;
+    if (len > CONSOLE_BUF_SIZE - start)
+      len = CONSOLE_BUF_SIZE - start;
+
+    if (backend == CONSOLE_DBCN) {
+      struct ret_sbi ret = call_sbi(len, (uint32_t)&console_buf[start], 0, 0, 0,
+                                    0, SBI_DBCN_WRITE, SBI_EXT_DBCN);
+      console_sbi_calls++;
+      if (ret.err != 0) {
+        console_dbcn = false; // Fall back to the legacy call for the rest
+        backend = CONSOLE_LEGACY;
+        continue;
+      }
+      len = ret.val;
+    } else {
+      for (uint32_t i = 0; i < len; i++)
+        call_sbi(console_buf[start + i], 0, 0, 0, 0, 0, 0, SBI_EXT_LEGACY_PUTCHAR);
+      console_sbi_calls += len;
+    }
+    console_tail += len;
+  }
+}
+
+void console_flush_to(uint32_t backend) {
+  spin_lock(&console_lock);
+  console_flush_locked(backend);
+  spin_unlock(&console_lock);
+}
+
+void console_flush(void) {
+  console_flush_to(CONSOLE_DEFAULT);
+}
+
+// Console
+// Start writing out queued output without waiting for it
+// With the UART this only primes the transmit FIFO; the transmit interrupt
+// feeds it the rest. The firmware paths are synchronous anyway.
+static void console_kick_locked(uint32_t backend) {
+  backend = console_backend(backend);
+  if (backend == CONSOLE_UART)
+    uart_tx_fill();
+  else
+    console_flush_locked(backend);
+}
+
+void console_kick(void) {
+  spin_lock(&console_lock);
+  console_kick_locked(CONSOLE_DEFAULT);
+  spin_unlock(&console_lock);
+}
+
+// Console
+// Queue len bytes for output
+// The ring is written out once the text contains a newline; a full ring is
+// drained synchronously. printf hands over each message in one call, so
+// messages from different harts never interleave. backend picks what the
+// ring is written out through (CONSOLE_UART only once uart_init has run); the
+// benchmarks use it to time each one.
+void console_write_to(const char *s, size_t len, uint32_t backend) {
+  uint32_t flags = spin_lock_irqsave(&console_lock);
+  bool newline = false;
+  for (size_t i = 0; i < len; i++) {
+    if (console_head - console_tail == CONSOLE_BUF_SIZE)
+      console_flush_locked(backend);
+    console_buf[console_head++ & (CONSOLE_BUF_SIZE - 1)] = s[i];
+    newline |= s[i] == '\n';
+  }
+  console_chars += len;
+  if (newline)
+    console_kick_locked(backend);
+  spin_unlock_irqrestore(&console_lock, flags);
+}
+
+void console_write(const char *s, size_t len) {
+  console_write_to(s, len, CONSOLE_DEFAULT);
+}
+
+// Console
+// Queue a single character for output
 void putchar(char ch) {
-  call_sbi(ch, -1, 0, 0, 0, 0, 0, 1);
+  console_write(&ch, 1);
+}
+
+// Console
+// Print how many characters went out and how many firmware calls that took,
+// and how much input was lost to a full receive ring
+// Once uart_init has run, output bypasses the firmware and only the
+// character count keeps growing.
+void console_report(void) {
+  uint32_t flags = spin_lock_irqsave(&console_lock);
+  uint32_t chars = console_chars, calls = console_sbi_calls;
+  uint32_t dropped = uart_rx_dropped;
+  spin_unlock_irqrestore(&console_lock, flags);
+  printf("console: %u chars, %u SBI calls, %u input bytes dropped\n", chars,
+         calls, dropped);
+}
+
+// Console
+// Read up to len bytes of input into buf
+// Sleeps until at least one byte has arrived, then returns what is there.
+// Only the UART delivers input, so before uart_init this never returns.
+uint32_t console_read(char *buf, uint32_t len) {
+  spin_lock(&console_lock);
+  while (uart_rx_head == uart_rx_tail)
+    sleep_on(&uart_rx_wait, &console_lock);
+
+  uint32_t n = 0;
+  while (n < len && uart_rx_tail != uart_rx_head)
+    buf[n++] = uart_rx_buf[uart_rx_tail++ & (UART_RX_BUF_SIZE - 1)];
+  spin_unlock(&console_lock);
+  return n;
+}
+
+// Devices
+// Take the console over from the firmware
+// The UART is left at the baud rate the firmware programmed. Receive
+// interrupts are enabled for good; transmit interrupts only while the output
+// ring has bytes waiting. The PLIC routes the UART to the S-mode context of
+// the calling (boot) hart.
+void uart_init(void) {
+  spin_lock(&console_lock);
+  console_flush_locked(CONSOLE_DEFAULT); // Anything queued so far still goes through the firmware
+
+  mmio_write8(UART_BASE + UART_IER, 0);
+  mmio_write8(UART_BASE + UART_FCR, UART_FCR_FIFO | UART_FCR_CLEAR);
+  mmio_write8(UART_BASE + UART_LCR, UART_LCR_8N1);
+  mmio_write8(UART_BASE + UART_MCR, UART_MCR_OUT2);
+  mmio_write8(UART_BASE + UART_IER, UART_IER_RDI);
+
+  plic_context = PLIC_SCONTEXT(this_cpu()->hartid);
+  mmio_write32(PLIC_PRIORITY(UART_IRQ), 1);
+  mmio_write32(PLIC_ENABLE(plic_context),
+               mmio_read32(PLIC_ENABLE(plic_context)) | (1u << UART_IRQ));
+  mmio_write32(PLIC_THRESHOLD(plic_context), 0);
+
+  list_init(&uart_rx_wait);
+  uart_ready = true;
+  spin_unlock(&console_lock);
+  WRITE_CSR(sie, READ_CSR(sie) | SIE_SEIE);
+}
+
+// Devices
+// UART interrupt: drain the receive FIFO into the ring, refill the transmit
+// FIFO, and wake readers if input arrived
+// TRACE_DUMP_KEY and STATS_KEY are taken out of the input. Their reports run
+// to hundreds of lines, far too long to print with this hart's interrupts
+// off, so they are left to the idle loop: the key sets a bit in
+// console_requests and an idle hart is woken to act on it.
+static void uart_interrupt(void) {
+  spin_lock(&console_lock);
+  bool received = false;
+  uint32_t requests = 0;
+  while (mmio_read8(UART_BASE + UART_LSR) & UART_LSR_DR) {
+    char ch = mmio_read8(UART_BASE + UART_RBR);
+    if (ch == STATS_KEY || ch == TRACE_DUMP_KEY) {
+      requests |= ch == STATS_KEY ? CONSOLE_REQ_STATS : CONSOLE_REQ_TRACE;
+      continue;
+    }
+    if (uart_rx_head - uart_rx_tail == UART_RX_BUF_SIZE) {
+      uart_rx_dropped++;
+      continue;
+    }
+    uart_rx_buf[uart_rx_head++ & (UART_RX_BUF_SIZE - 1)] = ch;
+    received = true;
+  }
+
+  uart_tx_fill();
+  if (received)
+    wake_up(&uart_rx_wait);
+  spin_unlock(&console_lock);
+  if (requests) {
+    __atomic_fetch_or(&console_requests, requests, __ATOMIC_SEQ_CST);
+    kick_idle_hart(this_cpu());
+  }
+}
+
+// Devices
+// Supervisor external interrupt: claim sources from the PLIC until none are
+// pending, completing each one after its handler ran
+static void handle_external_interrupt(void) {
+  uint32_t irq;
+  while ((irq = mmio_read32(PLIC_CLAIM(plic_context))) != 0) {
+    if (irq == UART_IRQ)
+      uart_interrupt();
+    else
+      printf("unexpected external interrupt %d\n", irq);
+    mmio_write32(PLIC_CLAIM(plic_context), irq);
+  }
 }
 
 // Kernel entry point for handling traps/exceptions
 // This function is called when a trap occurs
-// It saves all registers and then calls handle_trap
+// It saves registers into a trap_frame and then calls handle_trap
+// sscratch holds the kernel stack top while a process runs in U-mode and 0
+// while the hart is in the kernel, so a trap taken inside the kernel (such as
+// a timer interrupt) keeps using the stack it was already running on.
+// In the kernel tp points at the hart's struct cpu. A trap from U-mode loads
+// it from the trap frame's kernel_tp slot, which every return to U-mode
+// refills, since the process may come back on a different hart.
+//
+// There are two paths through it:
+// - Fast path (interrupts and system calls): only the registers C code may
+//   clobber are spilled, plus gp/tp, which switch_context does not preserve.
+//   s0-s11 are callee-saved, so handle_trap and anything it switches to hand
+//   them back untouched; their trap_frame slots are left stale.
+// - Full path (exceptions and fork): all 31 registers are saved, so fault
+//   handlers, debugging and fork see the complete trap_frame. A user ebreak
+//   is the cheapest way in, which bench_user.c uses to time this path.
 __attribute__((naked)) __attribute__((aligned(4))) void kernel_entry(void) {
   __asm__ __volatile__(
     "csrrw sp, sscratch, sp\n"
-    "addi sp, sp, -4 * 31\n"
-    // Save all registers to stack
+    "bnez sp, 1f\n"
+    "csrr sp, sscratch\n"   // Trap from the kernel: stay on the current stack
+    "1:\n"
+    "addi sp, sp, -4 * 32\n"
+    // Save caller-saved registers (and gp/tp) to stack
     "sw ra,  4 * 0(sp)\n"
     "sw gp,  4 * 1(sp)\n"
     "sw tp,  4 * 2(sp)\n"
@@ -132,6 +1088,33 @@ __attribute__((naked)) __attribute__((aligned(4))) void kernel_entry(void) {
     "sw a5,  4 * 15(sp)\n"
     "sw a6,  4 * 16(sp)\n"
     "sw a7,  4 * 17(sp)\n"
+
+    // Save original sp from sscratch
+    "csrr a0, sscratch\n"
+    "sw a0, 4 * 30(sp)\n"
+
+    // The hart is in the kernel now
+    "csrw sscratch, zero\n"
+
+    // Coming from U-mode, tp holds a user value: load this hart's struct cpu
+    // from the slot the last return to U-mode left it in
+    "csrr t0, sstatus\n"
+    "andi t0, t0, %[spp]\n"
+    "bnez t0, 6f\n"
+    "lw tp, 4 * 31(sp)\n"
+    "6:\n"
+
+    // Interrupts (scause bit 31 set) and ecalls from U-mode take the fast
+    // path, except fork, which copies the whole frame into the child
+    "csrr t0, scause\n"
+    "bltz t0, 3f\n"
+    "li t1, %[ecall_u]\n"
+    "bne t0, t1, 5f\n"
+    "li t1, %[sys_fork]\n"
+    "bne a7, t1, 3f\n"
+    "5:\n"
+
+    // Full path: save callee-saved registers too
     "sw s0,  4 * 18(sp)\n"
     "sw s1,  4 * 19(sp)\n"
     "sw s2,  4 * 20(sp)\n"
@@ -145,22 +1128,47 @@ __attribute__((naked)) __attribute__((aligned(4))) void kernel_entry(void) {
     "sw s10, 4 * 28(sp)\n"
     "sw s11, 4 * 29(sp)\n"
 
-    // Save original sp from sscratch
-    "csrr a0, sscratch\n"
-    "sw a0, 4 * 30(sp)\n"
+    // Call C trap handler
+    "mv a0, sp\n"
+    "call handle_trap\n"
 
-    // Set up new sscratch value
-    "addi a0, sp, 4 * 31\n"
-    "csrw sscratch, a0\n"
+    // Restore callee-saved registers (the handler may have edited them)
+    "lw s0,  4 * 18(sp)\n"
+    "lw s1,  4 * 19(sp)\n"
+    "lw s2,  4 * 20(sp)\n"
+    "lw s3,  4 * 21(sp)\n"
+    "lw s4,  4 * 22(sp)\n"
+    "lw s5,  4 * 23(sp)\n"
+    "lw s6,  4 * 24(sp)\n"
+    "lw s7,  4 * 25(sp)\n"
+    "lw s8,  4 * 26(sp)\n"
+    "lw s9,  4 * 27(sp)\n"
+    "lw s10, 4 * 28(sp)\n"
+    "lw s11, 4 * 29(sp)\n"
+    "j 4f\n"
 
-    // Call C trap handler
+    // Fast path: call C trap handler
+    "3:\n"
     "mv a0, sp\n"
     "call handle_trap\n"
 
-    // Restore all registers from stack
+    // Returning to U-mode: point sscratch back at the top of this kernel stack,
+    // note which hart the process left from and hand the user its tp back.
+    // Returning within the kernel keeps tp: the process may have moved to
+    // another hart while it was in here.
+    "4:\n"
+    "csrr a0, sstatus\n"
+    "andi a0, a0, %[spp]\n"
+    "bnez a0, 2f\n"
+    "sw tp, 4 * 31(sp)\n"
+    "addi a0, sp, 4 * 32\n"
+    "csrw sscratch, a0\n"
+    "lw tp, 4 * 2(sp)\n"
+    "2:\n"
+
+    // Restore caller-saved registers from stack
     "lw ra,  4 * 0(sp)\n"
     "lw gp,  4 * 1(sp)\n"
-    "lw tp,  4 * 2(sp)\n"
     "lw t0,  4 * 3(sp)\n"
     "lw t1,  4 * 4(sp)\n"
     "lw t2,  4 * 5(sp)\n"
@@ -176,20 +1184,11 @@ __attribute__((naked)) __attribute__((aligned(4))) void kernel_entry(void) {
     "lw a5,  4 * 15(sp)\n"
     "lw a6,  4 * 16(sp)\n"
     "lw a7,  4 * 17(sp)\n"
-    "lw s0,  4 * 18(sp)\n"
-    "lw s1,  4 * 19(sp)\n"
-    "lw s2,  4 * 20(sp)\n"
-    "lw s3,  4 * 21(sp)\n"
-    "lw s4,  4 * 22(sp)\n"
-    "lw s5,  4 * 23(sp)\n"
-    "lw s6,  4 * 24(sp)\n"
-    "lw s7,  4 * 25(sp)\n"
-    "lw s8,  4 * 26(sp)\n"
-    "lw s9,  4 * 27(sp)\n"
-    "lw s10, 4 * 28(sp)\n"
-    "lw s11, 4 * 29(sp)\n"
     "lw sp,  4 * 30(sp)\n"
     "sret\n"
+    :
+    : [spp] "i"(SSTATUS_SPP), [ecall_u] "i"(SCAUSE_ECALL_U),
+      [sys_fork] "i"(SYS_FORK)
   );
 }
 
@@ -240,15 +1239,55 @@ __attribute__((naked)) void switch_context(uint32_t *prev_sp,
 
 // System Interface
 // Handle traps/exceptions
-// Currently just panics with trap information
-// This is where page faults and other exceptions would be handled
-void handle_trap(void) {
+// Supervisor timer interrupts drive preemptive scheduling, external
+// interrupts come from devices through the PLIC, and ecalls from U-mode are
+// system calls; other traps kill a user process or panic
+// with trap information when they happen in the kernel
+// Page faults inside a process's VMAs are resolved by demand paging
+// sepc and sstatus belong to the hart, not the process, so they are saved
+// here and written back before returning: the timer path may switch to other
+// processes that take traps of their own before this one resumes.
+void handle_trap(struct trap_frame *f) {
   uint32_t scause = READ_CSR(scause);  // Cause of the trap
   uint32_t stval = READ_CSR(stval);    // Trap value
   uint32_t user_pc = READ_CSR(sepc);   // Program counter at trap
+  uint32_t sstatus = READ_CSR(sstatus); // Privilege and interrupt state at trap
+  trace(TRACE_HANDLER_ENTER, scause, user_pc);
+
+  if (scause == (SCAUSE_INTERRUPT | IRQ_S_TIMER)) {
+    handle_timer_interrupt();
+  } else if (scause == (SCAUSE_INTERRUPT | IRQ_S_EXTERNAL)) {
+    handle_external_interrupt();
+  } else if (scause == (SCAUSE_INTERRUPT | IRQ_S_SOFT)) {
+    handle_ipi();
+  } else if (scause == SCAUSE_ECALL_U) {
+    user_pc += 4; // Resume after the ecall instruction
+    curr_proc->syscall_pc = user_pc;
+    handle_syscall(f);
+  } else if (scause == SCAUSE_BREAKPOINT && !(sstatus & SSTATUS_SPP)) {
+    // No debugger to hand it to: step over the ebreak. Its low two bits tell
+    // ebreak (4 bytes) from c.ebreak (2 bytes). The page was just executed
+    // from, and user code is always mapped readable, so the load can't fault.
+    uint16_t insn = *(volatile uint16_t *)user_pc;
+    user_pc += (insn & 3) == 3 ? 4 : 2;
+  } else if ((scause == SCAUSE_INST_PAGE_FAULT ||
+              scause == SCAUSE_LOAD_PAGE_FAULT ||
+              scause == SCAUSE_STORE_PAGE_FAULT) &&
+             handle_page_fault(scause, stval)) {
+    // Demand-paged or copy-on-write page: it is mapped now, retry the access
+  } else if (!(sstatus & SSTATUS_SPP)) {
+    // A faulting user process is killed, the kernel keeps running
+    printf("process %d killed: scause=%x, stval=%x, sepc=%x\n",
+           curr_proc->pid, scause, stval, user_pc);
+    process_exit();
+  } else {
+    PANIC("unexpected trap scause=%x, stval=%x, sepc=%x\n", scause, stval,
+          user_pc);
+  }
 
-  PANIC("unexpected trap scause=%x, stval=%x, sepc=%x\n", scause, stval,
-        user_pc);
+  trace(TRACE_HANDLER_EXIT, scause, 0);
+  WRITE_CSR(sepc, user_pc);
+  WRITE_CSR(sstatus, sstatus);
 }
 
 // Virtual Memory Management
@@ -272,6 +1311,8 @@ void map_page(uint32_t *table1, uint32_t vaddr, paddr_t paddr, uint32_t flags) {
   if ((table1[vpn1] & PAGE_V) == 0) {
     uint32_t pt_paddr = alloc_pages(1);
     table1[vpn1] = ((pt_paddr / PAGE_SIZE) << 10) | PAGE_V;
+  } else if (table1[vpn1] & PAGE_RWX) {
+    PANIC("vaddr %x lies inside a megapage", vaddr);
   }
 
   // Extract VPN[0] (second level page table index)
@@ -282,157 +1323,1740 @@ void map_page(uint32_t *table1, uint32_t vaddr, paddr_t paddr, uint32_t flags) {
   table0[vpn0] = ((paddr / PAGE_SIZE) << 10) | flags | PAGE_V;
 }
 
-// Process Management
-// Create a new process with its own page table and stack
-// Sets up initial process state including:
-// - Page table with kernel space mapping
-// - Stack with initial register values
-// - Process control structure
-struct process *create_process(uint32_t pc) {
-  // Find unused process slot
-  struct process *proc = NULL;
-  int i;
-  for (i = 0; i < PROCS_MAX; i++) {
-    if (procs[i].state == PROC_UNUSED) {
-      proc = &procs[i];
-      break;
+// Virtual Memory Management
+// Map a contiguous range of size bytes starting at vaddr to paddr
+// Wherever vaddr and paddr are both 4MB aligned and a whole 4MB span remains,
+// a single level-1 leaf (megapage) is written instead of 1024 level-0 entries,
+// which also lets the TLB cover the span with one entry. The unaligned head and
+// tail of the range fall back to 4KB pages via map_page.
+void map_range(uint32_t *table1, uint32_t vaddr, paddr_t paddr, uint32_t size,
+               uint32_t flags) {
+  if (!is_aligned(size, PAGE_SIZE))
+    PANIC("unaligned size %x", size);
+
+  while (size > 0) {
+    uint32_t vpn1 = (vaddr >> 22) & TEN_ON_BITS;
+    if (is_aligned(vaddr, MEGAPAGE_SIZE) && is_aligned(paddr, MEGAPAGE_SIZE) &&
+        size >= MEGAPAGE_SIZE && (table1[vpn1] & PAGE_V) == 0) {
+      table1[vpn1] = ((paddr / PAGE_SIZE) << 10) | flags | PAGE_V;
+      vaddr += MEGAPAGE_SIZE;
+      paddr += MEGAPAGE_SIZE;
+      size -= MEGAPAGE_SIZE;
+    } else {
+      map_page(table1, vaddr, paddr, flags);
+      vaddr += PAGE_SIZE;
+      paddr += PAGE_SIZE;
+      size -= PAGE_SIZE;
     }
   }
+}
 
-  if (!proc)
-    PANIC("no free process slots");
+// Virtual Memory Management
+// Build the kernel's identity mapping once at boot, plus the device registers
+// at MMIO_BASE
+// Every process page table shares these second-level tables, so spawning a
+// process no longer maps (or allocates tables for) the whole kernel region.
+// Only the kernel may ever modify these tables.
+void init_kernel_page_table(void) {
+  kernel_page_table = (uint32_t *)alloc_pages(1);
+  map_range(kernel_page_table, (uint32_t)__kernel_base, (paddr_t)__kernel_base,
+            (paddr_t)__free_ram_end - (paddr_t)__kernel_base,
+            PAGE_R | PAGE_W | PAGE_X | PAGE_G);
+  map_range(kernel_page_table, PLIC_BASE, PLIC_PADDR, MEGAPAGE_SIZE,
+            PAGE_R | PAGE_W | PAGE_G);
+  map_page(kernel_page_table, UART_BASE, UART_PADDR, PAGE_R | PAGE_W | PAGE_G);
+}
 
-  // Set up initial stack with callee-saved registers
-  uint32_t *sp = (uint32_t *)&proc->stack[sizeof(proc->stack)];
-  *--sp = 0;            // s11
-  *--sp = 0;            // s10
-  *--sp = 0;            // s9
-  *--sp = 0;            // s8
-  *--sp = 0;            // s7
+// Virtual Memory Management
+// Find the level-0 PTE mapping vaddr, or NULL if there is no second-level table
+uint32_t *lookup_pte(uint32_t *table1, vaddr_t vaddr) {
+  uint32_t pte1 = table1[(vaddr >> 22) & TEN_ON_BITS];
+  if (!(pte1 & PAGE_V) || (pte1 & PAGE_RWX))
+    return NULL;
+
+  uint32_t *table0 = (uint32_t *)((pte1 >> 10) * PAGE_SIZE);
+  return &table0[(vaddr >> 12) & TEN_ON_BITS];
+}
+
+// Virtual Memory Management
+// TLB shootdown
+// A changed mapping may still be cached by every hart that ran the address
+// space. A batch collects the pages changed in one address space and
+// invalidates them once: locally with one sfence.vma per page, or one for the
+// whole ASID past TLB_BATCH_PAGES. Other harts in tlb_cpus are only marked in
+// tlb_stale, and yeild flushes the ASID there before the process runs on that
+// hart again; a hart it never returns to costs nothing. Only a hart running
+// the address space at this moment needs an SBI remote fence. With one
+// thread per process that is never another hart, but the check is what keeps
+// the lazy scheme correct.
+void tlb_batch_init(struct tlb_batch *batch, struct process *proc) {
+  batch->proc = proc;
+  batch->start = 0;
+  batch->end = 0;
+}
+
+void tlb_batch_add(struct tlb_batch *batch, vaddr_t vaddr) {
+  vaddr &= ~(PAGE_SIZE - 1);
+  if (batch->start == batch->end) {
+    batch->start = vaddr;
+    batch->end = vaddr + PAGE_SIZE;
+  } else if (vaddr < batch->start) {
+    batch->start = vaddr;
+  } else if (vaddr + PAGE_SIZE > batch->end) {
+    batch->end = vaddr + PAGE_SIZE;
+  }
+}
+
+static void flush_local(struct process *proc, vaddr_t start, vaddr_t end) {
+  if (end - start > TLB_BATCH_PAGES * PAGE_SIZE) {
+    if (asid_max)
+      __asm__ __volatile__("sfence.vma zero, %0" ::"r"(proc->asid) : "memory");
+    else
+      __asm__ __volatile__("sfence.vma" ::: "memory");
+    return;
+  }
+  for (vaddr_t vaddr = start; vaddr < end; vaddr += PAGE_SIZE) {
+    if (asid_max)
+      __asm__ __volatile__("sfence.vma %0, %1" ::"r"(vaddr), "r"(proc->asid)
+                           : "memory");
+    else
+      __asm__ __volatile__("sfence.vma %0" ::"r"(vaddr) : "memory");
+  }
+}
+
+// The stale marks are published before looking for harts running proc, and
+// yeild publishes cpu->curr before collecting its mark, so a hart switching
+// proc in at the same time is caught by one side or the other.
+void tlb_batch_flush(struct tlb_batch *batch) {
+  if (batch->start == batch->end)
+    return;
+
+  struct process *proc = batch->proc;
+  uint32_t begin = (uint32_t)read_time();
+  uint32_t irq = irq_save(); // Stay on the hart whose TLB is flushed locally
+  struct cpu *cpu = this_cpu();
+  uint32_t others = __atomic_load_n(&proc->tlb_cpus, __ATOMIC_SEQ_CST);
+  if (cpu->curr == proc) {
+    flush_local(proc, batch->start, batch->end);
+    others &= ~(1u << cpu->hartid);
+  }
+
+  if (others) {
+    __atomic_fetch_or(&proc->tlb_stale, others, __ATOMIC_SEQ_CST);
+    uint32_t live = 0;
+    for (uint32_t bits = others; bits; bits &= bits - 1) {
+      uint32_t hart = __builtin_ctz(bits);
+      if (__atomic_load_n(&cpus[hart].curr, __ATOMIC_SEQ_CST) == proc)
+        live |= 1u << hart;
+    }
+    if (live) {
+      uint32_t size = batch->end - batch->start;
+      if (asid_max)
+        call_sbi(live, 0, batch->start, size, proc->asid, 0,
+                 SBI_RFENCE_SFENCE_VMA_ASID, SBI_EXT_RFENCE);
+      else
+        call_sbi(live, 0, batch->start, size, 0, 0, SBI_RFENCE_SFENCE_VMA,
+                 SBI_EXT_RFENCE);
+      __atomic_fetch_add(&tlb_remote_fences, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&tlb_harts_skipped, __builtin_popcount(others & ~live),
+                       __ATOMIC_RELAXED);
+  }
+  irq_restore(irq);
+
+  batch->start = batch->end = 0;
+  __atomic_fetch_add(&tlb_batches, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&tlb_flush_ticks, (uint32_t)read_time() - begin,
+                     __ATOMIC_RELAXED);
+}
+
+// Invalidate one page of proc's address space everywhere
+void flush_tlb_page(struct process *proc, vaddr_t vaddr) {
+  struct tlb_batch batch;
+  tlb_batch_init(&batch, proc);
+  tlb_batch_add(&batch, vaddr);
+  tlb_batch_flush(&batch);
+}
+
+// Print how TLB invalidations were spread over the harts
+void tlb_report(void) {
+  uint32_t ticks_per_us = TIMEBASE_HZ / 1000000;
+  printf("tlb: %u batches, %u remote fences, %u harts skipped, "
+         "%u lazy flushes, %uus flushing, %u ipis\n",
+         tlb_batches, tlb_remote_fences, tlb_harts_skipped, tlb_lazy_flushes,
+         tlb_flush_ticks / ticks_per_us, ipis_sent);
+}
+
+// Virtual Memory Management
+// Virtual memory areas
+// A VMA reserves [start, end) of a process's address space with the given
+// page flags. Reserved pages are only backed by memory when first touched.
+struct vma *vma_add(struct process *proc, vaddr_t start, vaddr_t end,
+                    uint32_t flags) {
+  struct vma *vma = kmem_cache_alloc(&vma_cache);
+  vma->start = start;
+  vma->end = end;
+  vma->flags = flags;
+  list_push_back(&proc->vmas, &vma->node);
+  return vma;
+}
+
+struct vma *vma_find(struct process *proc, vaddr_t addr) {
+  for (struct list_node *n = proc->vmas.next; n != &proc->vmas; n = n->next) {
+    struct vma *vma = container_of(n, struct vma, node);
+    if (addr >= vma->start && addr < vma->end)
+      return vma;
+  }
+  return NULL;
+}
+
+// Copy-on-write
+// Resolve a write to a page shared with another address space after fork
+// The last sharer simply gets write access back; otherwise the writer gets a
+// private copy and drops its reference to the shared page.
+static void handle_cow_fault(struct process *proc, vaddr_t page_addr,
+                             uint32_t *pte) {
+  paddr_t old_page = (*pte >> 10) * PAGE_SIZE;
+  uint32_t flags = (*pte & 0x3ff & ~PAGE_COW) | PAGE_W;
+  if (paddr_to_page(old_page)->refcount == 1) {
+    *pte = (*pte & ~0x3ffu) | flags;
+  } else {
+    paddr_t new_page = alloc_pages(1);
+    memcpy((void *)new_page, (void *)old_page, PAGE_SIZE);
+    *pte = ((new_page / PAGE_SIZE) << 10) | flags;
+    page_put(old_page);
+  }
+  flush_tlb_page(proc, page_addr);
+  proc->cow_faults++;
+}
+
+// Copy-on-write
+// Share every user page of parent with child
+// Writable pages become read-only + PAGE_COW in both address spaces and gain
+// a reference; the first write by either side takes a copy-on-write fault.
+// With copy set the child gets a private copy of every page instead, and the
+// parent's mappings are left alone.
+static void share_address_space(struct process *parent, struct process *child,
+                                bool copy) {
+  struct tlb_batch batch;
+  tlb_batch_init(&batch, parent);
+  for (uint32_t vpn1 = 0; vpn1 < 1024; vpn1++) {
+    uint32_t pte1 = parent->page_table[vpn1];
+    if (!(pte1 & PAGE_V) || pte1 == kernel_page_table[vpn1] || (pte1 & PAGE_RWX))
+      continue;
+
+    uint32_t *table0 = (uint32_t *)((pte1 >> 10) * PAGE_SIZE);
+    for (uint32_t vpn0 = 0; vpn0 < 1024; vpn0++) {
+      uint32_t pte0 = table0[vpn0];
+      if (!(pte0 & PAGE_V) || !(pte0 & PAGE_U))
+        continue;
+
+      paddr_t paddr = (pte0 >> 10) * PAGE_SIZE;
+      if (copy) {
+        // A page still shared from an earlier fork is the child's alone now
+        uint32_t flags = pte0 & 0x3ff & ~PAGE_V;
+        if (flags & PAGE_COW)
+          flags = (flags & ~PAGE_COW) | PAGE_W;
+        paddr_t page = alloc_pages(1);
+        memcpy((void *)page, (void *)paddr, PAGE_SIZE);
+        map_page(child->page_table, (vpn1 << 22) | (vpn0 << 12), page, flags);
+        continue;
+      }
+
+      if (pte0 & PAGE_W) {
+        pte0 = (pte0 & ~PAGE_W) | PAGE_COW;
+        table0[vpn0] = pte0;
+        tlb_batch_add(&batch, (vpn1 << 22) | (vpn0 << 12));
+      }
+      page_get(paddr);
+      map_page(child->page_table, (vpn1 << 22) | (vpn0 << 12), paddr,
+               pte0 & 0x3ff & ~PAGE_V);
+    }
+  }
+
+  // The parent's cached writable translations are stale now
+  tlb_batch_flush(&batch);
+}
+
+// Resolve a page fault by demand paging
+// Writes to copy-on-write pages are resolved here as well.
+// Returns false when the access is not covered by a VMA that allows it (or
+// the page is already present), leaving the caller to treat it as a real fault.
+bool handle_page_fault(uint32_t scause, vaddr_t addr) {
+  trace(TRACE_PAGE_FAULT, addr, scause);
+  struct process *proc = curr_proc;
+  struct vma *vma = vma_find(proc, addr);
+  if (!vma)
+    return false;
+
+  uint32_t need = scause == SCAUSE_STORE_PAGE_FAULT ? PAGE_W
+                  : scause == SCAUSE_INST_PAGE_FAULT ? PAGE_X
+                                                     : PAGE_R;
+  if (!(vma->flags & need))
+    return false;
+
+  vaddr_t page_addr = addr & ~(PAGE_SIZE - 1);
+  uint32_t *pte = lookup_pte(proc->page_table, page_addr);
+  if (pte && (*pte & PAGE_V)) {
+    if (scause == SCAUSE_STORE_PAGE_FAULT && (*pte & PAGE_COW)) {
+      handle_cow_fault(proc, page_addr, pte);
+      return true;
+    }
+    return false;
+  }
+
+  map_page(proc->page_table, page_addr, alloc_pages(1), vma->flags);
+  flush_tlb_page(proc, page_addr);
+  proc->page_faults++;
+  proc->resident_pages++;
+  __atomic_fetch_add(&page_faults_total, 1, __ATOMIC_RELAXED);
+  return true;
+}
+
+// Unmap the user pages backing [start, end) of proc, dropping their references
+void unmap_user_range(struct process *proc, vaddr_t start, vaddr_t end) {
+  struct tlb_batch batch;
+  tlb_batch_init(&batch, proc);
+  for (vaddr_t vaddr = start; vaddr < end; vaddr += PAGE_SIZE) {
+    uint32_t *pte = lookup_pte(proc->page_table, vaddr);
+    if (!pte || !(*pte & PAGE_V))
+      continue;
+
+    page_put((*pte >> 10) * PAGE_SIZE);
+    *pte = 0;
+    tlb_batch_add(&batch, vaddr);
+    proc->resident_pages--;
+  }
+  tlb_batch_flush(&batch);
+}
+
+// Print page fault and residency counters for every process
+void vm_report(void) {
+  printf("page faults: %u total\n", page_faults_total);
+  spin_lock(&proc_lock);
+  for (struct list_node *n = proc_list.next; n != &proc_list; n = n->next) {
+    struct process *proc = container_of(n, struct process, all_node);
+    printf("  pid %d: %u faults, %u cow faults, %u resident pages\n", proc->pid,
+           proc->page_faults, proc->cow_faults, proc->resident_pages);
+  }
+  spin_unlock(&proc_lock);
+}
+
+// Timer
+// Read the 64-bit time CSR; rdtimeh is re-read to catch a carry between halves
+uint64_t read_time(void) {
+  uint32_t hi, lo, hi2;
+  do {
+    __asm__ __volatile__("rdtimeh %0" : "=r"(hi));
+    __asm__ __volatile__("rdtime %0" : "=r"(lo));
+    __asm__ __volatile__("rdtimeh %0" : "=r"(hi2));
+  } while (hi != hi2);
+  return ((uint64_t)hi << 32) | lo;
+}
+
+// Program the next supervisor timer interrupt through the SBI TIME extension
+// On RV32 the 64-bit deadline is split across a0 (low) and a1 (high)
+void set_timer(uint64_t when) {
+  call_sbi((uint32_t)when, (uint32_t)(when >> 32), 0, 0, 0, 0, SBI_TIME_SET_TIMER,
+           SBI_EXT_TIME);
+}
+
+
+// Scheduling
+// Latency histograms
+// Every hart records into them, so the counters are updated atomically
+static void latency_record(struct latency_hist *hist, uint32_t ticks) {
+  uint32_t bucket = 0;
+  while (bucket < LATENCY_BUCKETS - 1 && (ticks >> bucket) > 1)
+    bucket++;
+
+  __atomic_fetch_add(&hist->buckets[bucket], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+  uint32_t max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+  while (ticks > max &&
+         !__atomic_compare_exchange_n(&hist->max, &max, ticks, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+}
+
+// Upper bound (in ticks) of the bucket holding the given percentile
+uint32_t latency_percentile(struct latency_hist *hist, uint32_t percent) {
+  uint32_t target = hist->count * percent / 100;
+  uint32_t seen = 0;
+  for (uint32_t bucket = 0; bucket < LATENCY_BUCKETS; bucket++) {
+    seen += hist->buckets[bucket];
+    if (seen > target)
+      return 2u << bucket;
+  }
+  return hist->max;
+}
+
+// Print a latency distribution in microseconds
+static void latency_print(const char *name, struct latency_hist *hist) {
+  uint32_t ticks_per_us = TIMEBASE_HZ / 1000000;
+  printf("%s: n=%u p50<%uus p99<%uus max=%uus\n", name, hist->count,
+         latency_percentile(hist, 50) / ticks_per_us,
+         latency_percentile(hist, 99) / ticks_per_us,
+         hist->max / ticks_per_us);
+}
+
+// Record how long a runnable process waited between becoming ready and being
+// dispatched
+static void sched_record_wait(struct process *proc, uint64_t now) {
+  latency_record(&sched_wait, (uint32_t)(now - proc->ready_at));
+}
+
+// Print the run-queue waits, and how late sleeping processes woke up
+void sched_latency_report(void) {
+  latency_print("sched wait", &sched_wait);
+  latency_print("sleep late", &sleep_late);
+}
+
+// Print the counters every subsystem keeps
+void stats_report(void) {
+  console_report();
+  zero_pool_report();
+  sched_latency_report();
+  vm_report();
+  kmalloc_report();
+  lock_report();
+  tlb_report();
+  idle_report();
+  timer_report();
+}
+
+// Process Management
+// Run queues
+// Every hart has its own: one FIFO per priority level plus a bitmap with bit p
+// set while level p has runnable processes, so enqueue, dequeue and picking the
+// next process are O(1) regardless of how many processes exist. Level 0 is the
+// highest priority. Running processes and idle processes are never queued.
+// Callers hold cpu->lock.
+void runqueue_add(struct cpu *cpu, struct process *proc) {
+  list_push_back(&cpu->run_queues[proc->priority], &proc->run_node);
+  cpu->run_bitmap |= 1u << proc->priority;
+  cpu->nr_queued++;
+}
+
+void runqueue_remove(struct cpu *cpu, struct process *proc) {
+  list_remove(&proc->run_node);
+  if (list_empty(&cpu->run_queues[proc->priority]))
+    cpu->run_bitmap &= ~(1u << proc->priority);
+  cpu->nr_queued--;
+}
+
+// Dequeue the first process of the highest non-empty priority level
+struct process *runqueue_pick(struct cpu *cpu) {
+  if (!cpu->run_bitmap)
+    return NULL;
+
+  uint32_t prio = __builtin_ctz(cpu->run_bitmap); // Find first set
+  struct process *proc =
+      container_of(cpu->run_queues[prio].next, struct process, run_node);
+  runqueue_remove(cpu, proc);
+  return proc;
+}
+
+// Take a waiting process off another hart's run queues
+// Only used once this hart has nothing of its own to run. Victims are tried
+// starting with the next hart up so idle harts spread over the busy ones. A
+// process that is still switching out on its old hart (on_cpu) has registers
+// switch_context hasn't saved yet, so it is left where it is.
+static struct process *runqueue_steal(struct cpu *thief) {
+  for (uint32_t i = 1; i < MAX_HARTS; i++) {
+    struct cpu *victim = &cpus[(thief->hartid + i) & (MAX_HARTS - 1)];
+    if (!victim->online || !__atomic_load_n(&victim->nr_queued, __ATOMIC_RELAXED))
+      continue;
+
+    spin_lock(&victim->lock);
+    for (uint32_t bits = victim->run_bitmap; bits; bits &= bits - 1) {
+      struct list_node *queue = &victim->run_queues[__builtin_ctz(bits)];
+      for (struct list_node *n = queue->next; n != queue; n = n->next) {
+        struct process *proc = container_of(n, struct process, run_node);
+        if (__atomic_load_n(&proc->on_cpu, __ATOMIC_ACQUIRE))
+          continue;
+        runqueue_remove(victim, proc);
+        proc->cpu = thief;
+        thief->steals++;
+        spin_unlock(&victim->lock);
+        return proc;
+      }
+    }
+    spin_unlock(&victim->lock);
+  }
+  return NULL;
+}
+
+// Lock the hart whose run queues proc belongs to
+// proc->cpu only changes under the old hart's lock, so it is checked again
+// once that lock is held.
+static struct cpu *lock_proc_cpu(struct process *proc) {
+  while (true) {
+    struct cpu *cpu = __atomic_load_n(&proc->cpu, __ATOMIC_RELAXED);
+    spin_lock(&cpu->lock);
+    if (cpu == proc->cpu)
+      return cpu;
+    spin_unlock(&cpu->lock);
+  }
+}
+
+// Make sure some hart notices a process just queued on cpu
+// cpu is woken if it waits in wfi. If it is busy, another idle hart is woken
+// to steal the process instead. idle_loop announces itself in idle_harts
+// before its last look at the run queues, so either it sees the process or
+// the process's waker sees it.
+static void kick_idle_hart(struct cpu *cpu) {
+  uint32_t idle = __atomic_load_n(&idle_harts, __ATOMIC_SEQ_CST) &
+                  ~(1u << this_cpu()->hartid);
+  uint32_t target = 1u << cpu->hartid;
+  if (!(idle & target))
+    target = idle & -idle; // Lowest idle hart, if any
+  if (target)
+    send_ipi(target);
+}
+
+// Queue a newly built process on this hart
+// create_process leaves this to its callers, so no other hart can pick the
+// process up before its address space and kernel stack are complete.
+void wake_up_new(struct process *proc) {
+  struct cpu *cpu = lock_proc_cpu(proc);
+  runqueue_add(cpu, proc);
+  spin_unlock(&cpu->lock);
+  kick_idle_hart(cpu);
+}
+
+// Change a process's priority, moving it between queues if it is waiting
+void set_priority(struct process *proc, int priority) {
+  if (priority < 0 || priority >= PRIO_LEVELS)
+    PANIC("bad priority %d", priority);
+
+  struct cpu *cpu = lock_proc_cpu(proc);
+  bool queued = proc->state == PROC_RUNNABLE && proc->run_node.next != NULL;
+  if (queued)
+    runqueue_remove(cpu, proc);
+  proc->priority = priority;
+  if (queued)
+    runqueue_add(cpu, proc);
+  spin_unlock(&cpu->lock);
+}
+
+// Process Management
+// Wait queues
+// A blocked process is parked on a wait queue through its run_node, which is
+// free while it is off the run queues. Callers test their condition and call
+// sleep_on holding the lock that guards both the condition and wq, so a
+// wake_up from another hart or an interrupt handler can't slip in between the
+// test and the sleep. The lock is dropped while asleep and held again on return.
+void sleep_on(struct list_node *wq, struct spinlock *lock) {
+  struct process *proc = curr_proc;
+  proc->state = PROC_BLOCKED;
+  list_push_back(wq, &proc->run_node);
+  spin_unlock(lock);
+  yeild();
+  spin_lock(lock);
+}
+
+
+// Make a blocked process runnable again
+// The caller has already taken it off its wait queue.
+static void wake_process(struct process *proc, uint64_t now) {
+  struct cpu *cpu = lock_proc_cpu(proc);
+  proc->state = PROC_RUNNABLE;
+  proc->ready_at = now;
+  runqueue_add(cpu, proc);
+  spin_unlock(&cpu->lock);
+  trace(TRACE_WAKE, proc->pid, cpu->hartid);
+  kick_idle_hart(cpu);
+}
+
+// Make every process sleeping on wq runnable again
+// Called with the lock passed to sleep_on held. A sleeper can be woken before
+// its hart has switched away from it; yeild then finds it queued already.
+void wake_up(struct list_node *wq) {
+  uint64_t now = read_time();
+  while (!list_empty(wq)) {
+    struct process *proc = container_of(wq->next, struct process, run_node);
+    list_remove(&proc->run_node);
+    wake_process(proc, now);
+  }
+}
+
+// Process Management
+// Inter-processor interrupts
+void send_ipi(uint32_t hart_mask) {
+  call_sbi(hart_mask, 0, 0, 0, 0, 0, SBI_IPI_SEND, SBI_EXT_IPI);
+  __atomic_fetch_add(&ipis_sent, 1, __ATOMIC_RELAXED);
+}
+
+// The only IPIs the kernel sends wake an idle hart from wfi to look at the
+// run queues, or tell the boot hart the timer wheel has an earlier deadline.
+void handle_ipi(void) {
+  WRITE_CSR(sip, READ_CSR(sip) & ~SIP_SSIP);
+  timer_program();
+  if (this_cpu()->curr == this_cpu()->idle)
+    yeild();
+}
+
+// Scheduling
+// Timer wheel
+// A hashed hierarchical wheel: four levels of 64 slots, level l covering
+// 64^(l+1) jiffies ahead. Arming hashes the expiry into the one slot that
+// matches its distance and cancelling unlinks it, both O(1). Every 64 jiffies
+// the next level 1 slot is cascaded, its timers rehashed into level 0 (and
+// every 64 of those the next level 2 slot, and so on), so a timer moves down
+// at most three times before it expires from level 0.
+static void timer_init(void) {
+  spin_init(&timer_lock, "timer");
+  for (uint32_t level = 0; level < TIMER_LEVELS; level++)
+    for (uint32_t slot = 0; slot < TIMER_LEVEL_SIZE; slot++)
+      list_init(&timer_wheel[level][slot]);
+  jiffy_next = read_time() + JIFFY_TICKS;
+}
+
+// Put a timer in the slot for its distance from jiffies
+// timer_lock held. A timer due this jiffy can only come from a cascade, which
+// timer_run_jiffy does before running the current level 0 slot, so it goes
+// in that slot. Expiries already past go in the slot processed next.
+static void timer_enqueue(struct timer *timer) {
+  uint32_t delta = timer->expires - jiffies;
+  if ((int)delta < 0) {
+    delta = 1;
+    timer->expires = jiffies + 1;
+  }
+  uint32_t level = 0;
+  while (level < TIMER_LEVELS - 1 &&
+         delta >> ((level + 1) * TIMER_LEVEL_BITS))
+    level++;
+  uint32_t slot = (timer->expires >> (level * TIMER_LEVEL_BITS)) &
+                  (TIMER_LEVEL_SIZE - 1);
+  list_push_back(&timer_wheel[level][slot], &timer->node);
+  timers_pending++;
+}
+
+// First jiffy the wheel has to process: the next non-empty level 0 slot, or
+// the next cascade if that comes first. A level 0 timer past the cascade
+// costs one jiffy with nothing to do, which keeps the scan at 64 slots.
+static uint32_t timer_find_next(void) {
+  uint32_t cascade = (jiffies | (TIMER_LEVEL_SIZE - 1)) + 1;
+  for (uint32_t j = jiffies + 1; j != cascade; j++) {
+    if (!list_empty(&timer_wheel[0][j & (TIMER_LEVEL_SIZE - 1)]))
+      return j;
+  }
+  return cascade;
+}
+
+// Rehash every timer of a higher level slot one level down or more
+static void timer_cascade(struct list_node *slot) {
+  struct list_node moving;
+  list_init(&moving);
+  while (!list_empty(slot)) {
+    struct list_node *n = slot->next;
+    list_remove(n);
+    list_push_back(&moving, n);
+  }
+  while (!list_empty(&moving)) {
+    struct timer *timer = container_of(moving.next, struct timer, node);
+    list_remove(&timer->node);
+    timers_pending--;
+    timer_enqueue(timer);
+  }
+}
+
+// Process jiffy number jiffies: cascade if a level 0 round is complete, then
+// run every timer in its level 0 slot. Periodic timers go back on the wheel
+// before their callback runs.
+static void timer_run_jiffy(uint64_t now) {
+  uint32_t index = jiffies & (TIMER_LEVEL_SIZE - 1);
+  for (uint32_t level = 1; index == 0 && level < TIMER_LEVELS; level++) {
+    index = (jiffies >> (level * TIMER_LEVEL_BITS)) & (TIMER_LEVEL_SIZE - 1);
+    timer_cascade(&timer_wheel[level][index]);
+  }
+
+  struct list_node *slot = &timer_wheel[0][jiffies & (TIMER_LEVEL_SIZE - 1)];
+  while (!list_empty(slot)) {
+    struct timer *timer = container_of(slot->next, struct timer, node);
+    list_remove(&timer->node);
+    timers_pending--;
+    timers_expired++;
+    uint64_t late = now > timer->due ? now - timer->due : 0;
+    latency_record(&timer_jitter, late >> 32 ? 0xffffffff : (uint32_t)late);
+    trace(TRACE_TIMER, (uint32_t)timer->fn, (uint32_t)late);
+    if (timer->period) {
+      timer->expires = jiffies + timer->period;
+      timer->due += (uint64_t)timer->period * JIFFY_TICKS;
+      timer_enqueue(timer);
+    }
+    timer->fn(timer->arg);
+  }
+}
+
+// Skip the jiffies up to now that have nothing to process, returning whether
+// the wheel is still behind, that is a jiffy with work is due
+// timer_lock held. The 32-bit division undercounts a gap of more than 2^32
+// ticks; the wheel is then still behind and the caller comes round again.
+static bool timer_skip_quiet(uint64_t now) {
+  if (now < jiffy_next)
+    return false;
+  uint64_t behind = now - jiffy_next;
+  uint32_t passed =
+      (behind >> 32 ? 0xffffffff : (uint32_t)behind) / JIFFY_TICKS + 1;
+  uint32_t quiet = timers_pending ? timer_next - jiffies - 1 : passed;
+  uint32_t skip = quiet < passed ? quiet : passed;
+  jiffies += skip;
+  jiffy_next += (uint64_t)skip * JIFFY_TICKS;
+  return now >= jiffy_next;
+}
+
+// Bring the wheel up to date with the time CSR
+// Jiffies with nothing to process are skipped in one step, so a hart that
+// slept through many of them pays for the timers due, not for the gap.
+static void timer_advance(uint64_t now) {
+  spin_lock(&timer_lock);
+  while (timer_skip_quiet(now)) {
+    jiffies++;
+    jiffy_next += JIFFY_TICKS;
+    timer_run_jiffy(now);
+    if (timers_pending)
+      timer_next = timer_find_next();
+  }
+  spin_unlock(&timer_lock);
+}
+
+// time CSR value at which the wheel next has work, TIMER_NEVER if it is empty
+static uint64_t timer_deadline(void) {
+  spin_lock(&timer_lock);
+  uint64_t when = TIMER_NEVER;
+  if (timers_pending)
+    when = jiffy_next + (uint64_t)(timer_next - jiffies - 1) * JIFFY_TICKS;
+  spin_unlock(&timer_lock);
+  return when;
+}
+
+// Program this hart's timer interrupt for the next thing it has to do
+// Tickless, that is the end of the running process's slice (an idle hart has
+// none) and, on the boot hart, which keeps the wheel, its next deadline. A
+// hart with neither sleeps in wfi until an IPI or a device wakes it.
+// Otherwise every hart ticks TICK_HZ times a second. The SBI call is only made
+// when the deadline changes.
+static void timer_program(void) {
+  uint32_t irq = irq_save();
+  struct cpu *cpu = this_cpu();
+  uint64_t when;
+  if (TICKLESS) {
+    when = cpu->curr != cpu->idle ? cpu->slice_end : TIMER_NEVER;
+    if (cpu->hartid == boot_hartid) {
+      uint64_t next = timer_deadline();
+      if (next < when)
+        when = next;
+    }
+  } else {
+    uint64_t now = read_time();
+    when = cpu->timer_armed > now ? cpu->timer_armed : now + JIFFY_TICKS;
+  }
+  if (when != cpu->timer_armed) {
+    cpu->timer_armed = when;
+    set_timer(when);
+  }
+  irq_restore(irq);
+}
+
+// Link a timer into the wheel due delay jiffies from now
+// timer_lock held. Returns whether the wheel's next deadline moved earlier,
+// in which case the boot hart has to reprogram its timer.
+// Tickless, the boot hart only advances the wheel when it has work, so
+// jiffies can lag the time CSR by up to a cascade, or for as long as the
+// wheel is empty. The quiet jiffies are skipped first so that delay counts
+// from now rather than from the last time the wheel ran.
+static bool timer_start(struct timer *timer, uint32_t delay, uint32_t period) {
+  timer_skip_quiet(read_time());
+  if (timer->node.next) {
+    list_remove(&timer->node);
+    timers_pending--;
+  }
+  if (delay == 0)
+    delay = 1;
+  if (delay > TIMER_MAX_DELAY)
+    delay = TIMER_MAX_DELAY;
+  timer->expires = jiffies + delay;
+  timer->period = period;
+  timer->due = jiffy_next + (uint64_t)(delay - 1) * JIFFY_TICKS;
+  timers_armed++;
+
+  // The jiffy the wheel must wake up for this timer: its own in level 0,
+  // otherwise the next cascade
+  uint32_t event = delay < TIMER_LEVEL_SIZE
+                       ? timer->expires
+                       : (jiffies | (TIMER_LEVEL_SIZE - 1)) + 1;
+  bool earlier = !timers_pending || (int)(event - timer_next) < 0;
+  if (earlier)
+    timer_next = event;
+  timer_enqueue(timer);
+  return earlier;
+}
+
+// Tell the boot hart about a new earliest deadline
+static void timer_notify(void) {
+  if (TICKLESS)
+    send_ipi(1u << boot_hartid);
+}
+
+void timer_setup(struct timer *timer, void (*fn)(void *arg), void *arg) {
+  timer->node.next = timer->node.prev = NULL;
+  timer->period = 0;
+  timer->fn = fn;
+  timer->arg = arg;
+}
+
+// Start (or restart) a timer delay jiffies from now, repeating every period
+// jiffies if period is non-zero. Delays are clamped to 1..TIMER_MAX_DELAY.
+void timer_arm(struct timer *timer, uint32_t delay, uint32_t period) {
+  spin_lock(&timer_lock);
+  bool earlier = timer_start(timer, delay, period);
+  spin_unlock(&timer_lock);
+  if (earlier)
+    timer_notify();
+}
+
+// Stop a timer, returning whether it was pending
+// Callbacks run under timer_lock, so once this returns the callback is not
+// running and won't run again. The wheel's deadline is left alone: at worst
+// the boot hart wakes up once for nothing.
+bool timer_cancel(struct timer *timer) {
+  spin_lock(&timer_lock);
+  bool pending = timer->node.next != NULL;
+  if (pending) {
+    list_remove(&timer->node);
+    timers_pending--;
+    timers_cancelled++;
+  }
+  spin_unlock(&timer_lock);
+  return pending;
+}
+
+// Print the expiry jitter and how often each hart's timer went off
+void timer_report(void) {
+  printf("timers: %u armed, %u cancelled, %u expired\n", timers_armed,
+         timers_cancelled, timers_expired);
+  latency_print("timer jitter", &timer_jitter);
+  for (uint32_t hartid = 0; hartid < MAX_HARTS; hartid++) {
+    if (cpus[hartid].online)
+      printf("hart %u: %u timer interrupts\n", hartid, cpus[hartid].timer_irqs);
+  }
+}
+
+// Wake the process sleeping in sleep_jiffies
+static void sleep_expired(void *wq) {
+  wake_up(wq);
+}
+
+// Block the calling process for at least n jiffies
+// The current jiffy is already partly over, so the wakeup is due one jiffy
+// after the last full one. How late it actually runs goes into sleep_late.
+// The timer and the wait queue live on the sleeper's stack; the callback runs
+// under timer_lock, which the sleeper holds until sleep_on has parked it.
+// n is capped so the extra jiffy still fits the wheel.
+void sleep_jiffies(uint32_t n) {
+  if (n > TIMER_MAX_DELAY - 1)
+    n = TIMER_MAX_DELAY - 1;
+  uint64_t due = read_time() + (uint64_t)n * JIFFY_TICKS;
+  struct list_node wq;
+  struct timer timer;
+  list_init(&wq);
+  timer_setup(&timer, sleep_expired, &wq);
+
+  spin_lock(&timer_lock);
+  if (timer_start(&timer, n + 1, 0))
+    timer_notify();
+  while (timer.node.next)
+    sleep_on(&wq, &timer_lock);
+  spin_unlock(&timer_lock);
+
+  uint64_t now = read_time();
+  latency_record(&sleep_late, now > due ? (uint32_t)(now - due) : 0);
+}
+
+// Supervisor timer interrupt: run the timers that are due, and preempt the
+// running process if its slice is over
+// The SBI keeps the interrupt pending until the timer is set again, so
+// timer_armed is cleared to make sure timer_program (or yeild) does that.
+void handle_timer_interrupt(void) {
+  uint64_t now = read_time();
+  struct cpu *cpu = this_cpu();
+  cpu->timer_armed = 0;
+  cpu->timer_irqs++;
+  timer_advance(now);
+  if (now >= cpu->slice_end)
+    yeild();
+  timer_program();
+}
+
+// Process Management
+// Complete a switch on the hart that made it
+// Until switch_context has saved prev's registers no other hart may run prev,
+// so on_cpu is only cleared here, on the far side of the switch.
+void finish_switch(void) {
+  __atomic_store_n(&this_cpu()->prev->on_cpu, false, __ATOMIC_RELEASE);
+}
+
+// Process Management
+// First code a new process runs
+// switch_context "returns" here with the entry point in s0 and its argument
+// in s1. It finishes the switch yeild started, and since yeild masks
+// interrupts around the switch, enables them before entering the process. A
+// process whose entry function returns exits.
+__attribute__((naked)) void process_start(void) {
+  __asm__ __volatile__(
+      "call finish_switch\n"
+      "csrsi sstatus, %[sie]\n"
+      "mv a0, s1\n"
+      "jalr s0\n"
+      "j process_exit\n"
+      :
+      : [sie] "i"(SSTATUS_SIE));
+}
+
+// Process Management
+// Release everything a process owns
+// Second-level tables that are shared with kernel_page_table belong to the
+// kernel and are skipped; every other table is freed together with its
+// references to the user pages (PAGE_U leaves) it maps.
+static void free_address_space(uint32_t *table1) {
+  for (uint32_t vpn1 = 0; vpn1 < 1024; vpn1++) {
+    uint32_t pte1 = table1[vpn1];
+    if (!(pte1 & PAGE_V) || pte1 == kernel_page_table[vpn1] || (pte1 & PAGE_RWX))
+      continue;
+
+    uint32_t *table0 = (uint32_t *)((pte1 >> 10) * PAGE_SIZE);
+    for (uint32_t vpn0 = 0; vpn0 < 1024; vpn0++) {
+      uint32_t pte0 = table0[vpn0];
+      if ((pte0 & PAGE_V) && (pte0 & PAGE_U))
+        page_put((pte0 >> 10) * PAGE_SIZE);
+    }
+    free_pages((paddr_t)table0, 1);
+  }
+  free_pages((paddr_t)table1, 1);
+}
+
+static void free_process(struct process *proc) {
+  while (!list_empty(&proc->vmas)) {
+    struct vma *vma = container_of(proc->vmas.next, struct vma, node);
+    list_remove(&vma->node);
+    kmem_cache_free(&vma_cache, vma);
+  }
+  free_address_space(proc->page_table);
+  free_pages((paddr_t)proc->stack, KERNEL_STACK_SIZE / PAGE_SIZE);
+}
+
+// Whether any process other than the idle processes has yet to exit
+// Caller holds proc_lock.
+static bool processes_alive_locked(void) {
+  for (struct list_node *n = proc_list.next; n != &proc_list; n = n->next) {
+    struct process *proc = container_of(n, struct process, all_node);
+    if (proc->pid != 0 && proc->state != PROC_EXITED)
+      return true;
+  }
+  return false;
+}
+
+static bool processes_alive(void) {
+  spin_lock(&proc_lock);
+  bool alive = processes_alive_locked();
+  spin_unlock(&proc_lock);
+  return alive;
+}
+
+// Set by the hart that claims the statistics printed after the last process
+// exits, and once it has printed them
+static bool stats_printed;
+static bool stats_done;
+
+// Free every exited process
+// A process cannot release the kernel stack it is running on, so exit only
+// parks it on zombie_list. Any hart reaps it once its own hart has moved off
+// that stack, which finish_switch signals by clearing on_cpu. A zombie stays
+// on proc_list until its memory is back, so whoever waits for it to go (wait,
+// the benchmarks' leak checks) finds the pages free. Once the last process has
+// exited, its zombies are kept until the statistics have been printed, so
+// vm_report still lists them.
+void reap_zombies(void) {
+  while (true) {
+    struct process *zombie = NULL;
+    spin_lock(&proc_lock);
+    if (!__atomic_load_n(&stats_done, __ATOMIC_ACQUIRE) &&
+        !processes_alive_locked()) {
+      spin_unlock(&proc_lock);
+      return;
+    }
+    for (struct list_node *n = zombie_list.next; n != &zombie_list; n = n->next) {
+      struct process *proc = container_of(n, struct process, run_node);
+      if (!__atomic_load_n(&proc->on_cpu, __ATOMIC_ACQUIRE)) {
+        zombie = proc;
+        list_remove(&proc->run_node);
+        break;
+      }
+    }
+    spin_unlock(&proc_lock);
+
+    if (!zombie)
+      return;
+    free_process(zombie);
+    spin_lock(&proc_lock);
+    list_remove(&zombie->all_node);
+    wake_up(&exit_wait);
+    spin_unlock(&proc_lock);
+    kmem_cache_free(&proc_cache, zombie);
+  }
+}
+
+// Terminate the current process
+// It leaves the scheduler for good; its memory is reclaimed by reap_zombies
+__attribute__((noreturn)) void process_exit(void) {
+  irq_save();
+  struct process *proc = curr_proc;
+  spin_lock(&proc_lock);
+  proc->state = PROC_EXITED;
+  list_push_back(&zombie_list, &proc->run_node);
+  spin_unlock(&proc_lock);
+  yeild();
+  PANIC("exited process %d was rescheduled", curr_proc->pid);
+}
+
+// Pages that can be handed out right now, including the pre-zeroed pool and
+// the pages idle harts are zeroing for it
+uint32_t free_memory_pages(void) {
+  ticket_lock(&page_lock);
+  uint32_t pages = free_page_count + zero_pool_count + zero_pool_filling;
+  ticket_unlock(&page_lock);
+  return pages;
+}
+
+// Process Management
+// Lay out the registers switch_context pops the first time it switches to proc
+// It "returns" into process_start, which calls pc(arg) on the stack below sp
+static void init_context(struct process *proc, uint32_t *sp, uint32_t pc,
+                         uint32_t arg) {
+  *--sp = 0;            // s11
+  *--sp = 0;            // s10
+  *--sp = 0;            // s9
+  *--sp = 0;            // s8
+  *--sp = 0;            // s7
   *--sp = 0;            // s6
   *--sp = 0;            // s5
   *--sp = 0;            // s4
   *--sp = 0;            // s3
   *--sp = 0;            // s2
-  *--sp = 0;            // s1
-  *--sp = 0;            // s0
-  *--sp = (uint32_t)pc; // ra (return address = program counter)
+  *--sp = arg;          // s1 (argument passed to the entry point)
+  *--sp = (uint32_t)pc; // s0 (entry point picked up by process_start)
+  *--sp = (uint32_t)process_start; // ra
+  proc->sp = (uint32_t)sp;
+}
+
+// Process Management
+// Create a new process with its own page table and stack
+// Sets up initial process state including:
+// - Page table with kernel space mapping
+// - Stack with initial register values
+// - Process control structure
+struct process *create_process(uint32_t pc) {
+  // PCBs come from a slab cache and kernel stacks from the page allocator,
+  // so the number of processes is bounded only by free memory
+  struct process *proc = kmem_cache_alloc(&proc_cache);
+  memset(proc, 0, sizeof(*proc));
+  proc->stack = (uint8_t *)alloc_pages(KERNEL_STACK_SIZE / PAGE_SIZE);
+
+  // Set up initial stack with callee-saved registers
+  init_context(proc, (uint32_t *)&proc->stack[KERNEL_STACK_SIZE], pc, 0);
 
   // Create page table for the process
+  // The kernel half is shared: copying the first-level entries makes the new
+  // table point at the second-level tables built once by init_kernel_page_table
   uint32_t *page_table = (uint32_t *)alloc_pages(1);
-  // Map kernel space (identity mapping)
-  for (paddr_t paddr = (paddr_t)__kernel_base; paddr < (paddr_t)__free_ram_end;
-       paddr += PAGE_SIZE)
-    map_page(page_table, paddr, paddr, PAGE_R | PAGE_W | PAGE_X);
+  memcpy(page_table, kernel_page_table, PAGE_SIZE);
 
   // Initialize process fields
-  proc->pid = i + 1;
+  // The caller queues the process with wake_up_new once it is complete. Idle
+  // processes (pc == NULL) are never queued and all share pid 0.
   proc->state = PROC_RUNNABLE;
-  proc->sp = (uint32_t)sp;
   proc->page_table = page_table;
+  proc->ready_at = read_time();
+  proc->priority = PRIO_DEFAULT;
+  proc->cpu = this_cpu();
+  list_init(&proc->vmas);
+  spin_lock(&proc_lock);
+  proc->pid = pc ? next_pid++ : 0;
+  list_push_back(&proc_list, &proc->all_node);
+  spin_unlock(&proc_lock);
+  return proc;
+}
+
+// Virtual Memory Management
+// Discover how many ASID bits satp implements and switch to the kernel table
+// ASID 0 is reserved for the kernel's own address space. Kernel mappings are
+// global, so their TLB entries survive address space switches. Built with
+// -DASIDS=0 the kernel runs as if satp had none.
+void init_asid(void) {
+  uint32_t satp = SATP_SV32 | ((uint32_t)kernel_page_table / PAGE_SIZE);
+  WRITE_CSR(satp, satp | (SATP_ASID_MASK << SATP_ASID_SHIFT));
+  asid_max = ASIDS ? (READ_CSR(satp) >> SATP_ASID_SHIFT) & SATP_ASID_MASK : 0;
+  WRITE_CSR(satp, satp);
+  __asm__ __volatile__("sfence.vma");
+
+  asid_generation = 1;
+  asid_next = 1;
+}
+
+// Give proc a valid ASID for the current generation and return the generation
+// ASIDs are handed out in order and never reused within a generation. When
+// they run out a new generation starts, every process picks up a fresh ASID
+// the next time it is scheduled, and each hart flushes its whole TLB once when
+// it first switches in the new generation (see yeild).
+static uint32_t assign_asid(struct process *proc) {
+  spin_lock(&asid_lock);
+  if (proc->asid_gen != asid_generation) {
+    if (asid_next > asid_max) {
+      asid_generation++;
+      asid_next = 1;
+    }
+    proc->asid = asid_next++;
+    proc->asid_gen = asid_generation;
+    // No hart has cached anything under the new ASID yet
+    proc->tlb_cpus = 0;
+    proc->tlb_stale = 0;
+  }
+  uint32_t generation = asid_generation;
+  spin_unlock(&asid_lock);
+  return generation;
+}
+
+// Process Management
+// Kernel-side entry of a user process
+// Runs on the process's kernel stack, then drops to U-mode at USER_BASE with
+// sret. Interrupts stay masked until sret so no trap can see the half-set
+// sscratch; SPIE re-enables them in U-mode.
+__attribute__((noreturn)) void user_entry(void) {
+  irq_save();
+  WRITE_CSR(sepc, USER_BASE);
+  WRITE_CSR(sstatus, (READ_CSR(sstatus) & ~SSTATUS_SPP) | SSTATUS_SPIE);
+  // The first trap back in finds the hart's struct cpu where kernel_entry
+  // would have left it
+  uint8_t *stack_top = &curr_proc->stack[KERNEL_STACK_SIZE];
+  ((struct trap_frame *)stack_top - 1)->kernel_tp = (uint32_t)this_cpu();
+  WRITE_CSR(sscratch, (uint32_t)stack_top);
+  __asm__ __volatile__("mv tp, zero\n" // Don't hand the kernel's tp to the user
+                       "sret");
+  __builtin_unreachable();
+}
+
+// Process Management
+// Kernel-side entry of a forked child
+// process_start calls it with the user pc in a0 and sp pointing at the copy
+// of the parent's trap frame at the top of the kernel stack. Records the hart
+// it starts on in the frame, restores every register from it and returns to
+// U-mode.
+__attribute__((naked)) void fork_return(void) {
+  __asm__ __volatile__(
+      "csrci sstatus, %[sie]\n"
+      "csrw sepc, a0\n"
+      "li t0, %[spp]\n"
+      "csrc sstatus, t0\n"
+      "li t0, %[spie]\n"
+      "csrs sstatus, t0\n"
+      "sw tp, 4 * 31(sp)\n"
+      "addi t0, sp, 4 * 32\n"
+      "csrw sscratch, t0\n"
+      "lw ra,  4 * 0(sp)\n"
+      "lw gp,  4 * 1(sp)\n"
+      "lw tp,  4 * 2(sp)\n"
+      "lw t0,  4 * 3(sp)\n"
+      "lw t1,  4 * 4(sp)\n"
+      "lw t2,  4 * 5(sp)\n"
+      "lw t3,  4 * 6(sp)\n"
+      "lw t4,  4 * 7(sp)\n"
+      "lw t5,  4 * 8(sp)\n"
+      "lw t6,  4 * 9(sp)\n"
+      "lw a0,  4 * 10(sp)\n"
+      "lw a1,  4 * 11(sp)\n"
+      "lw a2,  4 * 12(sp)\n"
+      "lw a3,  4 * 13(sp)\n"
+      "lw a4,  4 * 14(sp)\n"
+      "lw a5,  4 * 15(sp)\n"
+      "lw a6,  4 * 16(sp)\n"
+      "lw a7,  4 * 17(sp)\n"
+      "lw s0,  4 * 18(sp)\n"
+      "lw s1,  4 * 19(sp)\n"
+      "lw s2,  4 * 20(sp)\n"
+      "lw s3,  4 * 21(sp)\n"
+      "lw s4,  4 * 22(sp)\n"
+      "lw s5,  4 * 23(sp)\n"
+      "lw s6,  4 * 24(sp)\n"
+      "lw s7,  4 * 25(sp)\n"
+      "lw s8,  4 * 26(sp)\n"
+      "lw s9,  4 * 27(sp)\n"
+      "lw s10, 4 * 28(sp)\n"
+      "lw s11, 4 * 29(sp)\n"
+      "lw sp,  4 * 30(sp)\n"
+      "sret\n"
+      :
+      : [sie] "i"(SSTATUS_SIE), [spp] "i"(SSTATUS_SPP),
+        [spie] "i"(SSTATUS_SPIE));
+}
+
+// Process Management
+// Create a U-mode process running a copy of a flat program image
+// The image is copied into fresh pages mapped at USER_BASE; the kernel half of
+// the address space stays inaccessible from U-mode because it lacks PAGE_U.
+// The heap (grown with sbrk) and the stack are only reserved as VMAs and get
+// memory page by page as the program touches them.
+struct process *create_user_process(const void *image, size_t image_size) {
+  struct process *proc = create_process((uint32_t)user_entry);
+  uint32_t flags = PAGE_U | PAGE_R | PAGE_W | PAGE_X;
+  for (uint32_t off = 0; off < image_size; off += PAGE_SIZE) {
+    paddr_t page = alloc_pages(1);
+    size_t remaining = image_size - off;
+    size_t copy_size = PAGE_SIZE <= remaining ? PAGE_SIZE : remaining;
+    memcpy((void *)page, (const uint8_t *)image + off, copy_size);
+    map_page(proc->page_table, USER_BASE + off, page, flags);
+    proc->resident_pages++;
+  }
+
+  vaddr_t image_end = USER_BASE + align_up(image_size, PAGE_SIZE);
+  vma_add(proc, USER_BASE, image_end, flags);
+  proc->heap = vma_add(proc, image_end, image_end, PAGE_U | PAGE_R | PAGE_W);
+  proc->brk = image_end;
+  vma_add(proc, USER_STACK_TOP - USER_STACK_SIZE, USER_STACK_TOP,
+          PAGE_U | PAGE_R | PAGE_W);
+  wake_up_new(proc);
   return proc;
 }
 
 // Process Management
 // Yield to next runnable process
 // Implements round-robin scheduling
+// Called voluntarily or from the timer interrupt when the slice runs out
 // Handles page table switching and context switching
 void yeild(void) {
-  struct process *next = idle_proc;
-  // Find next runnable process
-  for (int i = 0; i < PROCS_MAX; i++) {
-    struct process *proc = &procs[(curr_proc->pid + i) % PROCS_MAX];
-    if (proc->state == PROC_RUNNABLE && proc->pid > 0) {
-      next = proc;
-      break;
-    }
-  }
-  if (next == curr_proc) {
+  // The scheduler must not be re-entered from the timer interrupt
+  uint32_t irq = irq_save();
+  struct cpu *cpu = this_cpu();
+  struct process *curr = cpu->curr;
+  if (cpu->irq_depth)
+    PANIC("process %d yielded holding a spinlock", curr->pid);
+
+  // Round robin within a priority level: the current process goes to the
+  // back of its queue, then the head of the best non-empty queue runs. A
+  // sleeper woken before it got to switch away is queued already. With
+  // nothing queued here, work is taken from another hart.
+  spin_lock(&cpu->lock);
+  if (curr != cpu->idle && curr->state == PROC_RUNNABLE &&
+      curr->run_node.next == NULL)
+    runqueue_add(cpu, curr);
+  struct process *next = runqueue_pick(cpu);
+  spin_unlock(&cpu->lock);
+  if (!next)
+    next = runqueue_steal(cpu);
+  if (!next)
+    next = cpu->idle;
+  if (next == curr) {
+    // Nothing else wants the hart, so curr keeps it for another slice; left
+    // expired, the slice would have timer_program fire the timer right away
+    if (curr != cpu->idle)
+      cpu->slice_end = read_time() + sched_slice;
+    irq_restore(irq);
     return;
   }
 
+  uint64_t now = read_time();
+  curr->ready_at = now;
+  if (next != cpu->idle)
+    sched_record_wait(next, now);
+
+  // next stays marked on_cpu until it switches away again; curr is cleared
+  // by finish_switch on the other side, once its registers are saved
+  uint32_t generation = asid_max ? assign_asid(next) : 0;
+  uint32_t self = 1u << cpu->hartid;
+  next->on_cpu = true;
+  cpu->prev = curr;
+  __atomic_fetch_or(&next->tlb_cpus, self, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&cpu->curr, next, __ATOMIC_SEQ_CST);
+
+  // next's slice starts now. The timer only needs setting again if it would
+  // go off later than that, or a timer interrupt left it to be set again.
+  cpu->slice_end = now + sched_slice;
+  if (!cpu->timer_armed ||
+      (TICKLESS && next != cpu->idle && cpu->timer_armed > cpu->slice_end))
+    timer_program();
+  bool stale = __atomic_fetch_and(&next->tlb_stale, ~self, __ATOMIC_SEQ_CST) & self;
+
   // Switch page tables and stack pointers
-  __asm__ __volatile__(
-      "sfence.vma\n"  // Flush TLB
-      "csrw satp, %[satp]\n"  // Set new page table
-      "sfence.vma\n"  // Flush TLB again
-      "csrw sscratch, %[sscratch]\n"  // Set new stack pointer
-      :
-      : [satp] "r"(SATP_SV32 | ((uint32_t)next->page_table / PAGE_SIZE)),
-        [sscratch] "r"((uint32_t)&next->stack[sizeof(next->stack)]));
+  // With ASIDs the TLB keeps each address space's entries tagged, so writing
+  // satp is enough, except when the ASIDs were recycled since this hart last
+  // looked (full flush) or next's mappings changed since it last ran here
+  // (see tlb_batch_flush).
+  // Without ASID support every switch has to flush the whole TLB.
+  uint32_t satp = SATP_SV32 | ((uint32_t)next->page_table / PAGE_SIZE);
+  if (asid_max) {
+    satp |= next->asid << SATP_ASID_SHIFT;
+    if (satp != READ_CSR(satp))
+      WRITE_CSR(satp, satp);
+    if (cpu->asid_gen != generation) {
+      cpu->asid_gen = generation;
+      __asm__ __volatile__("sfence.vma" ::: "memory");
+    } else if (stale) {
+      __asm__ __volatile__("sfence.vma zero, %0" ::"r"(next->asid) : "memory");
+      __atomic_fetch_add(&tlb_lazy_flushes, 1, __ATOMIC_RELAXED);
+    }
+  } else {
+    __asm__ __volatile__(
+        "sfence.vma\n"  // Flush TLB
+        "csrw satp, %[satp]\n"  // Set new page table
+        "sfence.vma\n"  // Flush TLB again
+        :
+        : [satp] "r"(satp));
+  }
 
   // Perform context switch
-  struct process *prev_proc = curr_proc;
-  curr_proc = next;
-  switch_context(&prev_proc->sp, &next->sp);
+  trace(TRACE_SWITCH, curr->pid, next->pid);
+  switch_context(&curr->sp, &next->sp);
+  // Possibly on another hart now: cpu is stale from here on
+  finish_switch();
+  if (!list_empty(&zombie_list))
+    reap_zombies();
+  irq_restore(irq);
+}
+
+// System Interface
+// System calls
+// User programs issue ecall with the syscall number in a7 and arguments in
+// a0-a2 (see user.c). Handlers read them from the trap frame kernel_entry saved
+// and leave the return value in the frame's a0.
+static void sys_putchar(struct trap_frame *f) {
+  putchar(f->a0);
+}
+
+static void sys_getpid(struct trap_frame *f) {
+  f->a0 = curr_proc->pid;
 }
 
-// A function to simulate work.
-void delay(void) {
-  for (int i = 0; i < 500000000; i++) {
-    // Using "nop" instruction makes sure that the compiler does not 
-    // optimize and remove the loop which does not perform any work
-    __asm__ __volatile__("nop");
+static void sys_yield(struct trap_frame *f) {
+  (void)f;
+  yeild();
+}
+
+// Move the program break by a0 bytes and return the old break
+// Growing only widens the heap VMA; pages are faulted in on first touch.
+// Shrinking unmaps and frees whole pages that fall off the end.
+static void sys_sbrk(struct trap_frame *f) {
+  struct process *proc = curr_proc;
+  vaddr_t old_brk = proc->brk;
+  vaddr_t new_brk = old_brk + (int)f->a0;
+  vaddr_t new_end = align_up(new_brk, PAGE_SIZE);
+  if (new_brk < proc->heap->start || new_end > USER_STACK_TOP - USER_STACK_SIZE ||
+      ((int)f->a0 > 0 && new_brk < old_brk)) {
+    f->a0 = -1;
+    return;
   }
+
+  if (new_end < proc->heap->end)
+    unmap_user_range(proc, new_end, proc->heap->end);
+  proc->heap->end = new_end;
+  proc->brk = new_brk;
+  f->a0 = old_brk;
 }
 
-// User Process Entry Points
-// Process A: Prints 'A' repeatedly
-void proc_a_entry(void) {
-  printf("starting process A\n");
-  while (true) {
-    putchar('A');
-    yeild();
-    delay();    
+static void sys_exit(struct trap_frame *f) {
+  (void)f;
+  process_exit();
+}
+
+// Duplicate the calling process
+// The child shares the parent's pages copy-on-write (or, when a0 is FORK_COPY,
+// gets a copy of each of them now) and resumes in U-mode right
+// after the ecall with a0 = 0; the parent gets the child's pid. fork takes the
+// full-frame path through kernel_entry, so f holds every user register. The
+// child resumes at the pc handle_trap noted on entry: sepc itself may have
+// been overwritten by an interrupt or a fault taken since.
+static void sys_fork(struct trap_frame *f) {
+  struct process *parent = curr_proc;
+  bool copy = f->a0 == FORK_COPY;
+  struct process *child = create_process((uint32_t)fork_return);
+
+  struct vma *heap = NULL;
+  for (struct list_node *n = parent->vmas.next; n != &parent->vmas; n = n->next) {
+    struct vma *vma = container_of(n, struct vma, node);
+    struct vma *copy = vma_add(child, vma->start, vma->end, vma->flags);
+    if (vma == parent->heap)
+      heap = copy;
+  }
+  child->heap = heap;
+  child->brk = parent->brk;
+  child->resident_pages = parent->resident_pages;
+  share_address_space(parent, child, copy);
+
+  // Put a copy of the trap frame at the top of the child's kernel stack, where
+  // kernel_entry would have saved it, and start the child below it
+  uint32_t *child_sp = (uint32_t *)&child->stack[KERNEL_STACK_SIZE] -
+                       sizeof(struct trap_frame) / sizeof(uint32_t);
+  struct trap_frame *child_frame = (struct trap_frame *)child_sp;
+  *child_frame = *f;
+  child_frame->a0 = 0;
+  init_context(child, child_sp, (uint32_t)fork_return, parent->syscall_pc);
+  wake_up_new(child);
+
+  f->a0 = child->pid;
+}
+
+// Check that every byte of [addr, addr + len) lies in one of the process's
+// VMAs, writable ones if the kernel is going to write there
+// The kernel can reach every user page (SUM), so a pointer passed in by a
+// process must not be allowed to name kernel memory instead. Nor may it name
+// a hole between VMAs: handle_page_fault refuses those, and an S-mode fault
+// it refuses is a kernel panic.
+static bool user_range_ok(uint32_t addr, uint32_t len, bool write) {
+  if (addr < USER_BASE || addr + len < addr || addr + len > USER_STACK_TOP)
+    return false;
+  uint32_t end = addr + len;
+  while (addr < end) {
+    struct vma *vma = vma_find(curr_proc, addr);
+    if (!vma || !(vma->flags & (write ? PAGE_W : PAGE_R)))
+      return false;
+    addr = vma->end;
+  }
+  return true;
+}
+
+// Read console input into a user buffer, blocking until some is available
+static void sys_read(struct trap_frame *f) {
+  if (!user_range_ok(f->a0, f->a1, true)) {
+    f->a0 = -1;
+    return;
+  }
+  f->a0 = f->a1 ? console_read((char *)f->a0, f->a1) : 0;
+}
+
+// Write a user buffer to the console
+static void sys_write(struct trap_frame *f) {
+  if (!user_range_ok(f->a0, f->a1, false)) {
+    f->a0 = -1;
+    return;
+  }
+  console_write((const char *)f->a0, f->a1);
+  f->a0 = f->a1;
+}
+
+// Sleep for a0 ticks of 1/TICK_HZ seconds
+// Negative counts and ones longer than the timer wheel reaches are refused.
+static void sys_sleep(struct trap_frame *f) {
+  if ((int)f->a0 < 0 || f->a0 > TIMER_MAX_DELAY - 1) {
+    f->a0 = -1;
+    return;
+  }
+  sleep_jiffies(f->a0);
+  f->a0 = 0;
+}
+
+// Process with the given pid, or NULL once it has been reaped
+// proc_lock held.
+static struct process *find_process(int pid) {
+  for (struct list_node *n = proc_list.next; n != &proc_list; n = n->next) {
+    struct process *proc = container_of(n, struct process, all_node);
+    if (proc->pid == pid && pid != 0)
+      return proc;
+  }
+  return NULL;
+}
+
+// Block until process a0 has exited and been reaped, so its memory is free
+// There are no parent links or exit codes: any process may wait for any other.
+// Every reap wakes every waiter, which then looks its pid up again.
+static void sys_wait(struct trap_frame *f) {
+  int pid = (int)f->a0;
+  spin_lock(&proc_lock);
+  bool found = pid != curr_proc->pid && find_process(pid);
+  while (found && find_process(pid))
+    sleep_on(&exit_wait, &proc_lock);
+  spin_unlock(&proc_lock);
+  f->a0 = found ? 0 : -1;
+}
+
+typedef void (*syscall_fn)(struct trap_frame *f);
+
+static const syscall_fn syscall_table[] = {
+    [SYS_PUTCHAR] = sys_putchar,
+    [SYS_GETPID] = sys_getpid,
+    [SYS_YIELD] = sys_yield,
+    [SYS_EXIT] = sys_exit,
+    [SYS_SBRK] = sys_sbrk,
+    [SYS_FORK] = sys_fork,
+    [SYS_READ] = sys_read,
+    [SYS_WRITE] = sys_write,
+    [SYS_SLEEP] = sys_sleep,
+    [SYS_WAIT] = sys_wait,
+};
+
+void handle_syscall(struct trap_frame *f) {
+  uint32_t sysno = f->a7;
+  if (sysno >= sizeof(syscall_table) / sizeof(syscall_table[0]) ||
+      !syscall_table[sysno]) {
+    f->a0 = -1;
+    return;
+  }
+  syscall_table[sysno](f);
+}
+
+// Boot Process
+// Set up a hart's struct cpu and point its tp at it
+static void cpu_init(uint32_t hartid) {
+  // cpus[] and trace_rings[] only have room for hart ids below MAX_HARTS. A
+  // hart beyond that borrows the last slot just long enough to panic, since
+  // printing takes locks and those need tp.
+  if (hartid >= MAX_HARTS) {
+    __asm__ __volatile__("mv tp, %0" ::"r"(&cpus[MAX_HARTS - 1]));
+    PANIC("hart %u is beyond MAX_HARTS (%u)", hartid, MAX_HARTS);
+  }
+
+  struct cpu *cpu = &cpus[hartid];
+  cpu->hartid = hartid;
+  spin_init(&cpu->lock, "cpu");
+  for (int prio = 0; prio < PRIO_LEVELS; prio++)
+    list_init(&cpu->run_queues[prio]);
+  __asm__ __volatile__("mv tp, %0" ::"r"(cpu));
+}
+
+// Boot Process
+// Give hart its idle process, which doubles as the context it boots in
+static struct process *cpu_idle_init(uint32_t hartid) {
+  struct process *idle = create_process((uint32_t)NULL);
+  idle->cpu = &cpus[hartid];
+  idle->on_cpu = true;
+  cpus[hartid].idle = idle;
+  cpus[hartid].curr = idle;
+  return idle;
+}
+
+// Boot Process
+// Let the hart take part in scheduling: arm its first time slice and let the
+// timer interrupt in
+static void cpu_online(void) {
+  struct cpu *cpu = this_cpu();
+  WRITE_CSR(sscratch, 0);
+  // Let the kernel read and write user pages (syscall arguments)
+  WRITE_CSR(sstatus, READ_CSR(sstatus) | SSTATUS_SUM);
+  // Let user programs time themselves with rdtime and rdcycle
+  WRITE_CSR(scounteren, SCOUNTEREN_CY | SCOUNTEREN_TM);
+  __atomic_store_n(&cpu->online, true, __ATOMIC_RELEASE);
+  __atomic_fetch_add(&nr_cpus, 1, __ATOMIC_RELAXED);
+  WRITE_CSR(sie, READ_CSR(sie) | SIE_STIE | SIE_SSIE);
+  timer_program();
+  WRITE_CSR(sstatus, READ_CSR(sstatus) | SSTATUS_SIE);
+}
+
+// Whether any hart has a process waiting to run
+static bool work_queued(void) {
+  for (uint32_t hartid = 0; hartid < MAX_HARTS; hartid++) {
+    if (cpus[hartid].online &&
+        __atomic_load_n(&cpus[hartid].nr_queued, __ATOMIC_SEQ_CST))
+      return true;
   }
+  return false;
 }
 
-// Process B: Prints 'B' repeatedly
-void proc_b_entry(void) {
-  printf("starting process B\n");
+// Idle loop: every hart's boot context becomes its idle process once
+// scheduling starts. It prepares zeroed pages whenever no other process
+// wants the hart, then waits in wfi for the next interrupt: a timer tick, a
+// device, or an IPI from kick_idle_hart. Interrupts are masked from the last
+// look at the run queues until wfi, so a wakeup can't be taken in between
+// and then slept through; wfi still returns for a pending masked interrupt,
+// which is taken once they are unmasked again.
+// The first hart to find that the last user process has exited prints the
+// statistics, before the process is reaped so vm_report still lists it. Idle
+// harts also print the reports asked for from the console; a key pressed
+// while this hart was on its way to wfi keeps it awake.
+__attribute__((noreturn)) static void idle_loop(void) {
+  struct cpu *cpu = this_cpu();
+  uint32_t self = 1u << cpu->hartid;
   while (true) {
-    putchar('B');
+    if (!__atomic_load_n(&stats_printed, __ATOMIC_RELAXED) &&
+        !processes_alive() &&
+        !__atomic_exchange_n(&stats_printed, true, __ATOMIC_SEQ_CST)) {
+      stats_report();
+      __atomic_store_n(&stats_done, true, __ATOMIC_RELEASE);
+    }
+    uint32_t requests =
+        __atomic_exchange_n(&console_requests, 0, __ATOMIC_SEQ_CST);
+    if (requests & CONSOLE_REQ_STATS)
+      stats_report();
+    if (requests & CONSOLE_REQ_TRACE)
+      trace_dump();
+    reap_zombies();
+    zero_pool_refill();
+    console_kick(); // Output that didn't end with a newline
     yeild();
-    delay();    
+
+    uint32_t irq = irq_save();
+    __atomic_fetch_or(&idle_harts, self, __ATOMIC_SEQ_CST);
+    if (!work_queued() &&
+        !__atomic_load_n(&console_requests, __ATOMIC_SEQ_CST)) {
+      timer_program();
+      spin_lock(&cpu->lock);
+      cpu->idle_since = read_time();
+      spin_unlock(&cpu->lock);
+      __asm__ __volatile__("wfi");
+      spin_lock(&cpu->lock);
+      cpu->idle_time += read_time() - cpu->idle_since;
+      cpu->idle_since = 0;
+      spin_unlock(&cpu->lock);
+    }
+    __atomic_fetch_and(&idle_harts, ~self, __ATOMIC_SEQ_CST);
+    irq_restore(irq);
+  }
+}
+
+// Time cpu has spent in wfi, counting the wait it may be in right now
+// A hart can sleep for as long as nothing wakes it, so idle_time alone lags.
+// Both are 64-bit, which rv32 can't load in one go, so they are read under
+// the hart's lock.
+uint64_t cpu_idle_time(struct cpu *cpu) {
+  spin_lock(&cpu->lock);
+  uint64_t idle = cpu->idle_time;
+  if (cpu->idle_since)
+    idle += read_time() - cpu->idle_since;
+  spin_unlock(&cpu->lock);
+  return idle;
+}
+
+// Print how much of the time since boot each hart spent in wfi
+// Both times are scaled down by 2^10 ticks first, to stay in 32-bit division.
+void idle_report(void) {
+  uint32_t uptime = (uint32_t)((read_time() - boot_time) >> 10);
+  for (uint32_t hartid = 0; hartid < MAX_HARTS; hartid++) {
+    struct cpu *cpu = &cpus[hartid];
+    if (!cpu->online)
+      continue;
+    uint32_t idle = (uint32_t)(cpu_idle_time(cpu) >> 10);
+    printf("hart %u: %u%% idle, %u steals\n", hartid, idle / (uptime / 100 + 1),
+           cpu->steals);
+  }
+}
+
+// Boot Process
+// Start every other hart the firmware has parked
+// Each one boots on the kernel stack of the idle process made for it here.
+// Harts that are missing or already running report another status and are
+// left alone. Only hart ids below MAX_HARTS are probed, so harts numbered
+// beyond that stay parked instead of indexing past cpus[].
+static void start_secondary_harts(void) {
+  for (uint32_t hartid = 0; hartid < MAX_HARTS; hartid++) {
+    if (hartid == boot_hartid)
+      continue;
+    struct ret_sbi status = call_sbi(hartid, 0, 0, 0, 0, 0,
+                                     SBI_HSM_HART_GET_STATUS, SBI_EXT_HSM);
+    if (status.err || status.val != SBI_HSM_STOPPED)
+      continue;
+
+    struct process *idle = cpu_idle_init(hartid);
+    struct ret_sbi ret =
+        call_sbi(hartid, (uint32_t)secondary_boot,
+                 (uint32_t)&idle->stack[KERNEL_STACK_SIZE], 0, 0, 0,
+                 SBI_HSM_HART_START, SBI_EXT_HSM);
+    if (ret.err)
+      printf("hart %u failed to start: %d\n", hartid, ret.err);
   }
 }
 
 // Boot Process
 // Main kernel function
 // Initializes the system and starts process scheduling
-void kernel_main(void) {
+void kernel_main(uint32_t hartid) {
   // Clear BSS section
   memset(__bss, 0, (size_t)__bss_end - (size_t)__bss);
 
+  // Everything from here on may take spinlocks, which need tp
+  boot_hartid = hartid;
+  cpu_init(hartid);
+  ticket_init(&page_lock, "page");
+  spin_init(&proc_lock, "proc");
+  spin_init(&console_lock, "console");
+  spin_init(&asid_lock, "asid");
+  boot_time = read_time();
+
+  // Batch console output if the firmware allows it
+  console_init();
+
+  // Hand free RAM over to the page allocator
+  init_pages();
+  list_init(&proc_list);
+  list_init(&zombie_list);
+  list_init(&exit_wait);
+  kmem_cache_init(&proc_cache, "process", sizeof(struct process), NULL);
+  kmem_cache_init(&vma_cache, "vma", sizeof(struct vma), NULL);
+  kmalloc_init();
+
+  // Build the kernel mapping shared by every address space
+  init_kernel_page_table();
+  init_asid();
+
+  // Console I/O through the UART from here on
+  uart_init();
+
   printf("\n\n");
 
   // Set up trap vector
   WRITE_CSR(stvec, (uint32_t)kernel_entry);
   
+  // Kernel timers, sleepers included, wait on the timer wheel
+  timer_init();
+
   // Create processes
-  idle_proc = create_process((uint32_t)NULL);
-  idle_proc->pid = 0;
-  curr_proc = idle_proc;
-  proc_a = create_process((uint32_t)proc_a_entry);
-  proc_b = create_process((uint32_t)proc_b_entry);
-  
-  // Start scheduling
-  yeild();
-  PANIC("unreachable here");
+  cpu_idle_init(hartid);
+#ifdef BENCH
+  // run.sh bench: the harness replaces the demo and starts the user half
+  // (bench_user.c, linked in as app.bin) itself
+  wake_up_new(create_process((uint32_t)bench_main));
+#else
+  create_user_process(_binary_app_bin_start, (size_t)_binary_app_bin_size);
+  create_user_process(_binary_app_bin_start, (size_t)_binary_app_bin_size);
+#endif
+
+  // Bring up the other harts; idle ones steal work from busy ones
+  sched_slice = TIMEBASE_HZ / 1000 * SCHED_SLICE_MS;
+  start_secondary_harts();
+  cpu_online();
+  idle_loop();
+}
+
+// Boot Process
+// Main function of the other harts
+// Runs on its idle process's kernel stack, with the MMU off and nothing but
+// the hart id to go on. Everything shared is already set up by the boot hart.
+void secondary_main(uint32_t hartid) {
+  cpu_init(hartid);
+  WRITE_CSR(satp, SATP_SV32 | ((uint32_t)kernel_page_table / PAGE_SIZE));
+  __asm__ __volatile__("sfence.vma");
+  WRITE_CSR(stvec, (uint32_t)kernel_entry);
+  cpu_online();
+  idle_loop();
+}
+
+// Boot Process
+// First code a secondary hart runs
+// The firmware starts it with its hart id in a0 and the opaque argument of
+// sbi_hart_start, its stack top, in a1.
+__attribute__((naked)) void secondary_boot(void) {
+  __asm__ __volatile__(
+      "mv sp, a1\n"
+      "j secondary_main\n");
 }
 
 // Boot Process
 // First code to run
-// Sets up initial stack and jumps to kernel_main
+// Sets up initial stack and jumps to kernel_main, keeping the hart id the
+// firmware passed in a0
 __attribute__((section(".text.boot")))
 __attribute__((naked))
 void boot(void) {
   // Set up stack and jump to kernel_main
   __asm__ __volatile__(
-      "mv sp, %[stack_top]\n"
+      "la sp, __stack_top\n"
       "j kernel_main\n"
-      :
-      : [stack_top] "r"(__stack_top)
   );
 }
-
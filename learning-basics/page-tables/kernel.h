@@ -6,6 +6,7 @@
  *    - Process states and limits
  *    - Process control structure
  *    - Process stack layout
+ *    - Per-hart state (struct cpu) and spinlocks
  * 
  * 2. Memory Management
  *    - Page table flags and permissions
@@ -27,9 +28,45 @@
 #include "common.h"
 
 // Process Management
-#define PROCS_MAX 8                // Maximum number of processes supported
-#define PROC_UNUSED 0              // Process slot is free
+#define PROC_UNUSED 0              // Process is being set up
 #define PROC_RUNNABLE 1            // Process is ready to run
+#define PROC_EXITED 2              // Process has exited, waiting to be reaped
+#define PROC_BLOCKED 3             // Process is sleeping on a wait queue
+#define KERNEL_STACK_SIZE 8192     // Per-process kernel stack, from alloc_pages
+#define MAX_HARTS 8                // Harts the kernel can drive (hart ids 0..7)
+#define LOCK_REGISTRY_SIZE 32      // Locks lock_report can list
+
+// Scheduling
+#define TIMEBASE_HZ 10000000       // Frequency of the time CSR on QEMU virt
+#define SCHED_SLICE_MS 10          // Default time slice before preemption
+#define LATENCY_BUCKETS 32         // log2 buckets of a latency histogram
+#define JIFFY_TICKS (TIMEBASE_HZ / TICK_HZ) // time CSR ticks per jiffy
+#define TIMER_LEVELS 4             // Levels of the hierarchical timer wheel
+#define TIMER_LEVEL_BITS 6         // log2 of the slots per level
+#define TIMER_LEVEL_SIZE (1u << TIMER_LEVEL_BITS)
+#define TIMER_MAX_DELAY ((1u << (TIMER_LEVELS * TIMER_LEVEL_BITS)) - 1) // In jiffies
+#define TIMER_NEVER ((uint64_t)-1) // set_timer deadline that never comes
+#ifndef TICKLESS
+#define TICKLESS 1                 // Program the next deadline, not a periodic tick
+#endif
+#define PRIO_LEVELS 32             // Priority levels, 0 is the highest
+#define PRIO_DEFAULT 16            // Priority given to new processes
+
+// Tracing
+#ifndef TRACE
+#define TRACE 1                    // Record events in the per-hart trace rings
+#endif
+#define TRACE_ENTRIES 1024         // Events each hart's ring keeps (power of two)
+#define TRACE_DUMP_KEY 0x14        // Ctrl-T on the console runs trace_dump
+#define TRACE_SWITCH 1             // yeild: a = pid switched from, b = pid switched to
+#define TRACE_HANDLER_ENTER 2      // handle_trap, registers saved: a = scause, b = sepc
+#define TRACE_HANDLER_EXIT 3       // handle_trap, before restoring them: a = scause
+#define TRACE_PAGE_FAULT 4         // handle_page_fault: a = address, b = scause
+#define TRACE_ALLOC 5              // alloc_pages: a = paddr, b = pages
+#define TRACE_FREE 6               // free_pages: a = paddr, b = pages
+#define TRACE_WAKE 7               // wake_process: a = pid, b = hart it is queued on
+#define TRACE_TIMER 8              // Timer expiry: a = callback, b = ticks late
+#define TRACE_MARK 9               // Marker, a and b up to the caller (bench.c)
 
 // System Interface
 // CSR (Control and Status Register) operations
@@ -46,20 +83,143 @@
     __asm__ __volatile__("csrw " #reg ", %0" ::"r"(__tmp));                    \
   } while (0)
 
+// Trap causes and interrupt control bits
+#define SCAUSE_INTERRUPT (1u << 31) // scause: trap was an interrupt
+#define IRQ_S_SOFT 1                // Supervisor software interrupt code (IPI)
+#define IRQ_S_TIMER 5               // Supervisor timer interrupt code
+#define IRQ_S_EXTERNAL 9            // Supervisor external interrupt code (PLIC)
+#define SIE_SSIE (1 << 1)           // sie: supervisor software interrupt enable
+#define SIE_STIE (1 << 5)           // sie: supervisor timer interrupt enable
+#define SIP_SSIP (1 << 1)           // sip: supervisor software interrupt pending
+#define SIE_SEIE (1 << 9)           // sie: supervisor external interrupt enable
+#define SSTATUS_SIE (1 << 1)        // sstatus: interrupts enabled in S-mode
+#define SSTATUS_SPIE (1 << 5)       // sstatus: SIE before the trap
+#define SSTATUS_SPP (1 << 8)        // sstatus: trap came from S-mode
+#define SSTATUS_SUM (1 << 18)       // sstatus: S-mode may access user pages
+#define SCOUNTEREN_CY (1 << 0)      // scounteren: U-mode may read cycle
+#define SCOUNTEREN_TM (1 << 1)      // scounteren: U-mode may read time
+#define SCAUSE_BREAKPOINT 3         // ebreak
+#define SCAUSE_ECALL_U 8            // Environment call from U-mode
+#define SCAUSE_INST_PAGE_FAULT 12   // Instruction fetch page fault
+#define SCAUSE_LOAD_PAGE_FAULT 13   // Load page fault
+#define SCAUSE_STORE_PAGE_FAULT 15  // Store/AMO page fault
+
+// Mask supervisor interrupts, returning whether they were enabled
+static inline uint32_t irq_save(void) {
+  uint32_t sstatus;
+  __asm__ __volatile__("csrrci %0, sstatus, %1"
+                       : "=r"(sstatus)
+                       : "i"(SSTATUS_SIE)
+                       : "memory");
+  return sstatus & SSTATUS_SIE;
+}
+
+// Re-enable supervisor interrupts if irq_save found them enabled
+static inline void irq_restore(uint32_t enabled) {
+  if (enabled)
+    __asm__ __volatile__("csrsi sstatus, %0" ::"i"(SSTATUS_SIE) : "memory");
+}
+
+// Devices
+// QEMU virt places the PLIC and the NS16550 UART inside the range user
+// programs use, so the kernel maps their registers at MMIO_BASE instead of
+// identity mapping them.
+#define PLIC_PADDR 0x0c000000      // Platform-level interrupt controller
+#define UART_PADDR 0x10000000      // NS16550 UART
+#define MMIO_BASE 0xf0000000       // Kernel virtual address of the device registers
+#define PLIC_BASE MMIO_BASE        // One 4MB megapage: sources, enables, contexts
+#define UART_BASE (MMIO_BASE + MEGAPAGE_SIZE) // One 4KB page
+
+// PLIC registers
+// QEMU virt gives every hart an M-mode and an S-mode context; device
+// interrupts are routed to the S-mode context of the boot hart only
+#define PLIC_SCONTEXT(hart) (2 * (hart) + 1)
+#define PLIC_PRIORITY(irq) (PLIC_BASE + 4 * (irq))
+#define PLIC_ENABLE(ctx) (PLIC_BASE + 0x2000 + 0x80 * (ctx))
+#define PLIC_THRESHOLD(ctx) (PLIC_BASE + 0x200000 + 0x1000 * (ctx))
+#define PLIC_CLAIM(ctx) (PLIC_THRESHOLD(ctx) + 4) // Read to claim, write to complete
+#define UART_IRQ 10                // PLIC source wired to the UART
+
+// NS16550 registers (byte offsets) and bits
+#define UART_RBR 0                 // Receive buffer (read)
+#define UART_THR 0                 // Transmit holding (write)
+#define UART_IER 1                 // Interrupt enable
+#define UART_FCR 2                 // FIFO control (write)
+#define UART_LCR 3                 // Line control
+#define UART_MCR 4                 // Modem control
+#define UART_LSR 5                 // Line status
+#define UART_IER_RDI (1 << 0)      // Interrupt when received data is available
+#define UART_IER_THRI (1 << 1)     // Interrupt when the transmit FIFO is empty
+#define UART_FCR_FIFO (1 << 0)     // Enable the FIFOs
+#define UART_FCR_CLEAR (3 << 1)    // Reset both FIFOs
+#define UART_LCR_8N1 3             // 8 data bits, no parity, 1 stop bit
+#define UART_MCR_OUT2 (1 << 3)     // Gates the interrupt line on a real 16550
+#define UART_LSR_DR (1 << 0)       // Received data ready
+#define UART_LSR_THRE (1 << 5)     // Transmit FIFO empty
+#define UART_FIFO_SIZE 16          // Bytes the transmit FIFO holds
+#define UART_RX_BUF_SIZE 256       // Receive ring size in bytes (power of two)
+#define STATS_KEY 0x12             // Ctrl-R on the console runs stats_report
+#define CONSOLE_REQ_STATS (1 << 0) // STATS_KEY pressed: idle loop runs stats_report
+#define CONSOLE_REQ_TRACE (1 << 1) // TRACE_DUMP_KEY pressed: it runs trace_dump
+
+// Device register access
+static inline uint8_t mmio_read8(uint32_t addr) {
+  return *(volatile uint8_t *)addr;
+}
+
+static inline void mmio_write8(uint32_t addr, uint8_t val) {
+  *(volatile uint8_t *)addr = val;
+}
+
+static inline uint32_t mmio_read32(uint32_t addr) {
+  return *(volatile uint32_t *)addr;
+}
+
+static inline void mmio_write32(uint32_t addr, uint32_t val) {
+  *(volatile uint32_t *)addr = val;
+}
+
 // Memory Management
 // Page table configuration
 #define SATP_SV32 (1u << 31)      // Enable Sv32 paging mode
+#define SATP_ASID_SHIFT 22        // Position of the ASID field in satp
+#define SATP_ASID_MASK 0x1ff      // Sv32 ASIDs are at most 9 bits wide
+#ifndef ASIDS
+#define ASIDS 1                    // Use ASIDs when satp implements them
+#endif
+#define TLB_BATCH_PAGES 16        // Larger batches flush the whole address space
 #define PAGE_V (1 << 0)           // Page table entry valid bit
 #define PAGE_R (1 << 1)           // Page is readable
 #define PAGE_W (1 << 2)           // Page is writable
 #define PAGE_X (1 << 3)           // Page is executable
 #define PAGE_U (1 << 4)           // Page is user-accessible
+#define PAGE_G (1 << 5)           // Mapping exists in every address space
+#define PAGE_COW (1 << 8)         // Software bit: read-only share of a writable page
+#define PAGE_RWX (PAGE_R | PAGE_W | PAGE_X) // Any of these set marks a leaf entry
+#define MEGAPAGE_SIZE (4 * 1024 * 1024) // Region mapped by one level-1 leaf
+
+// Physical page allocator (buddy system)
+#define PAGE_ORDER_MAX 10         // Largest block is 2^10 pages (4MB)
+#define PG_FREE (1 << 0)          // Block is sitting in a free list
+#define ZERO_POOL_TARGET 64       // Pre-zeroed pages kept ready by the idle process
+
+// Kernel heap (kmalloc)
+#define KMALLOC_MIN 16u           // Smallest size class in bytes
+#define KMALLOC_CLASSES 8         // Power of two classes: 16B up to 2KB
+#define KMALLOC_MAX (KMALLOC_MIN << (KMALLOC_CLASSES - 1))
+
+// User address space
+#define USER_BASE 0x1000000       // Where user images are mapped (see user.ld)
 
 // Page table index masks
 #define TEN_ON_BITS 0x3ff         // Mask for 10-bit page table indices
 
 // System Control
 // Trap handling structure - matches the register save order in kernel_entry
+// The frame of a trap from U-mode always sits at the very top of the kernel
+// stack, which is where kernel_entry finds kernel_tp again.
+// s0-s11 are only saved for exceptions and fork; on the interrupt and system
+// call fast path those slots hold stale values and must not be used
 struct trap_frame {
   uint32_t ra;    // Return address
   uint32_t gp;    // Global pointer
@@ -92,18 +252,267 @@ struct trap_frame {
   uint32_t s10;
   uint32_t s11;
   uint32_t sp;    // Stack pointer
+  uint32_t kernel_tp; // Traps from U-mode: the hart's struct cpu, stored on
+                      // the way out because tp belongs to the user meanwhile
 } __attribute__((packed));
 
+// Intrusive doubly linked list
+// Embed a list_node in a structure and use container_of to get back to it.
+// A node that is not on any list has next == NULL.
+struct list_node {
+  struct list_node *next;
+  struct list_node *prev;
+};
+
+static inline void list_init(struct list_node *head) {
+  head->next = head->prev = head;
+}
+
+static inline bool list_empty(struct list_node *head) {
+  return head->next == head;
+}
+
+static inline void list_push_back(struct list_node *head,
+                                  struct list_node *node) {
+  node->next = head;
+  node->prev = head->prev;
+  head->prev->next = node;
+  head->prev = node;
+}
+
+static inline void list_remove(struct list_node *node) {
+  node->prev->next = node->next;
+  node->next->prev = node->prev;
+  node->next = node->prev = NULL;
+}
+
+// Memory Management
+// Virtual memory area - a reserved, lazily backed user address range
+struct vma {
+  vaddr_t start;              // First address (page aligned)
+  vaddr_t end;                // One past the last address (page aligned)
+  uint32_t flags;             // PAGE_* flags for pages faulted in
+  struct list_node node;      // Link in the owning process's vmas list
+};
+
 // Process Management
 // Process control structure
 struct process {
   int pid;                    // Process identifier
   int state;                  // Current process state
   vaddr_t sp;                 // Stack pointer
+  vaddr_t syscall_pc;         // U-mode pc the system call in progress returns to
   uint32_t *page_table;       // Process page table
-  uint8_t stack[8192];        // Process kernel stack
+  uint32_t asid;              // Address space identifier tagging TLB entries
+  uint32_t asid_gen;          // ASID generation the asid belongs to
+  uint64_t ready_at;          // Time the process last became ready to run
+  int priority;               // Run queue level, 0 is the highest
+  struct list_node run_node;  // Link in its run queue (or zombie list once exited)
+  struct list_node all_node;  // Link in the list of all processes
+  struct list_node vmas;      // Reserved user address ranges (struct vma)
+  struct vma *heap;           // Heap VMA, grown and shrunk by sbrk
+  vaddr_t brk;                // Current program break
+  uint32_t page_faults;       // Demand-paging faults served
+  uint32_t resident_pages;    // User pages currently backed by memory
+  uint32_t cow_faults;        // Copy-on-write faults served
+  uint8_t *stack;             // Process kernel stack (KERNEL_STACK_SIZE bytes)
+  struct cpu *cpu;            // Hart whose run queue the process belongs to
+  uint32_t tlb_cpus;          // Harts whose TLB may hold entries of its ASID
+  uint32_t tlb_stale;         // Harts that must flush its ASID before running it
+  bool on_cpu;                // Still running or being switched away from
+};
+
+// Scheduling
+// Latency distribution: log2 buckets of timer ticks, updated atomically
+struct latency_hist {
+  uint32_t buckets[LATENCY_BUCKETS]; // Bucket b counts latencies below 2^(b+1)
+  uint32_t count;             // Latencies recorded
+  uint32_t max;               // Largest one, in ticks
+};
+
+// Scheduling
+// Kernel timer: calls fn(arg) from the timer interrupt once its jiffy has
+// passed, then every period jiffies if period is non-zero
+struct timer {
+  struct list_node node;      // Link in its timer wheel slot, next == NULL if idle
+  uint32_t expires;           // Jiffy it is due at
+  uint32_t period;            // Jiffies between expiries, 0 for a one-shot timer
+  uint64_t due;               // time CSR value of that jiffy (for timer_jitter)
+  void (*fn)(void *arg);      // Callback, run with timer_lock held
+  void *arg;                  // Its argument
+};
+
+// Tracing
+// One trace event: the low word of the time CSR and what happened (TRACE_*)
+struct trace_event {
+  uint32_t time;              // time CSR, low 32 bits
+  uint32_t type;              // TRACE_* event type
+  uint32_t a;                 // Event arguments, see the TRACE_* definitions
+  uint32_t b;
+};
+
+// A hart's trace ring: the last TRACE_ENTRIES events it recorded
+// Only its own hart writes it, with interrupts masked, so no lock is needed.
+struct trace_ring {
+  uint32_t head;              // Events recorded so far; head % TRACE_ENTRIES is next
+  uint32_t reserved[3];       // Keeps events 16-byte aligned in memory dumps
+  struct trace_event events[TRACE_ENTRIES];
 };
 
+// Synchronization
+// Statistics a lock keeps about itself, updated only while it is held
+struct lock_stats {
+  const char *name;           // For lock_report
+  uint32_t acquired;          // Times taken
+  uint32_t contended;         // Times the taker had to wait for it
+  uint32_t hold_ticks;        // Total time held, in timer ticks (wraps)
+  uint32_t hold_max;          // Longest single hold, in timer ticks
+  uint32_t locked_at;         // Low half of the time CSR when last taken
+};
+
+// Spinlock: a word swapped with amoswap until the old value is 0
+// Holding a lock keeps interrupts masked on the hart, so an interrupt handler
+// can never spin on a lock its own hart holds.
+struct spinlock {
+  uint32_t locked;            // 1 while held
+  struct lock_stats stats;
+};
+
+// Ticket lock: takers draw a number with amoadd and are served in order
+// A contended spinlock goes to whichever hart's amoswap lands first, so one
+// hart can keep losing; a ticket lock hands over first come, first served.
+// Interrupts stay masked while it is held, as with spinlocks.
+struct ticketlock {
+  uint32_t next;              // Next ticket to hand out
+  uint32_t owner;             // Ticket allowed in
+  struct lock_stats stats;
+};
+
+// Process Management
+// Per-hart state, reached through tp while the hart is in the kernel
+struct cpu {
+  uint32_t hartid;            // Hart id, also the index into cpus[]
+  bool online;                // Hart has entered the scheduler
+  struct process *curr;       // Running process
+  struct process *idle;       // Runs whenever nothing else is runnable
+  struct process *prev;       // Process just switched away from (finish_switch)
+  uint32_t irq_depth;         // Spinlocks held, see push_off
+  uint32_t irq_enabled;       // Whether interrupts were on before the first
+  uint32_t asid_gen;          // ASID generation this hart's TLB has caught up with
+  struct spinlock lock;       // Protects the run queues and idle times
+  struct list_node run_queues[PRIO_LEVELS]; // One FIFO per priority level
+  uint32_t run_bitmap;        // Bit p set while run_queues[p] is non-empty
+  uint32_t nr_queued;         // Processes waiting in the run queues
+  uint32_t steals;            // Processes taken from other harts' queues
+  uint64_t idle_time;         // Timer ticks spent waiting in wfi (under lock)
+  uint64_t idle_since;        // When the current wfi began, or 0 (under lock)
+  uint64_t slice_end;         // time CSR value the running process's slice ends at
+  uint64_t timer_armed;       // Deadline last given to set_timer, 0 to set it again
+  uint32_t timer_irqs;        // Timer interrupts taken
+};
+
+// The hart's own struct cpu
+// volatile: a process can resume on another hart after any call that may
+// switch, so tp must be read again every time.
+static inline struct cpu *this_cpu(void) {
+  struct cpu *cpu;
+  __asm__ __volatile__("mv %0, tp" : "=r"(cpu));
+  return cpu;
+}
+
+#define curr_proc (this_cpu()->curr)  // Process running on this hart
+
+// Tracing
+extern struct trace_ring trace_rings[MAX_HARTS]; // One per hart, in kernel.c
+
+// Record an event in this hart's trace ring
+// A handful of instructions and no lock or SBI call, so it can go anywhere,
+// interrupt handlers and spinlock holders included. Interrupts are masked so
+// an interrupt's events can't land in the middle of this one, and so the
+// process can't move to another hart halfway.
+static inline void trace(uint32_t type, uint32_t a, uint32_t b) {
+  if (!TRACE)
+    return;
+  uint32_t irq = irq_save();
+  struct trace_ring *ring = &trace_rings[this_cpu()->hartid];
+  struct trace_event *event = &ring->events[ring->head++ & (TRACE_ENTRIES - 1)];
+  uint32_t time;
+  __asm__ __volatile__("rdtime %0" : "=r"(time));
+  event->time = time;
+  event->type = type;
+  event->a = a;
+  event->b = b;
+  irq_restore(irq);
+}
+
+// Memory Management
+// Physical page descriptor - one per page of the free RAM region
+struct page {
+  struct page *next;          // Next block in the same free list
+  struct page *prev;          // Previous block in the same free list
+  uint8_t order;              // Block size as a power of two (head page only)
+  uint8_t flags;              // PG_* flags
+  uint16_t slab_inuse;        // Slab pages: objects handed out
+  uint32_t refcount;          // Mappings of the page (user pages, see page_get)
+  struct kmem_cache *slab_cache; // Slab pages: owning cache
+  void *slab_free;            // Slab pages: chain of free objects
+};
+
+// Memory Management
+// Cache of equally sized objects carved out of whole pages
+struct kmem_cache {
+  const char *name;           // For diagnostics
+  void (*ctor)(void *obj);    // Runs on each object when its slab is carved
+  uint32_t obj_size;          // Slot size: object rounded up to pointer
+                              // alignment, plus the link word with a ctor
+  uint32_t free_offset;       // Where a free object keeps its free-list link
+  uint32_t objs_per_slab;     // Objects carved out of one page
+  struct page partial;        // Head of the list of slabs with free objects
+  uint32_t nr_slabs;          // Pages owned by the cache
+  uint32_t nr_active;         // Objects currently allocated
+  struct spinlock lock;       // Protects everything above and the slabs
+};
+
+// Memory Management
+// TLB invalidations for one address space, gathered while its page table is
+// edited and flushed together: one local flush and at most one remote fence
+struct tlb_batch {
+  struct process *proc;       // Address space whose mappings changed
+  vaddr_t start;              // First page touched
+  vaddr_t end;                // End of the last page touched
+};
+
+// System Interface
+// SBI extensions
+#define SBI_EXT_TIME 0x54494d45    // "TIME": timer programming
+#define SBI_TIME_SET_TIMER 0       // sbi_set_timer(stime_value)
+#define SBI_EXT_BASE 0x10          // Base extension: version and probing
+#define SBI_BASE_PROBE_EXT 3       // sbi_probe_extension(extension_id)
+#define SBI_EXT_DBCN 0x4442434e    // "DBCN": debug console
+#define SBI_DBCN_WRITE 0           // sbi_debug_console_write(len, base_lo, base_hi)
+#define SBI_EXT_LEGACY_PUTCHAR 1   // Legacy sbi_console_putchar(ch)
+#define SBI_EXT_HSM 0x48534d       // "HSM": hart state management
+#define SBI_HSM_HART_START 0       // sbi_hart_start(hartid, start_addr, opaque)
+#define SBI_HSM_HART_GET_STATUS 2  // sbi_hart_get_status(hartid)
+#define SBI_HSM_STOPPED 1          // Status of a hart that can be started
+#define SBI_EXT_IPI 0x735049       // "sPI": inter-processor interrupts
+#define SBI_IPI_SEND 0             // sbi_send_ipi(hart_mask, hart_mask_base)
+#define SBI_EXT_RFENCE 0x52464e43  // "RFNC": remote fences
+#define SBI_RFENCE_SFENCE_VMA 1    // sbi_remote_sfence_vma(mask, base, start, size)
+#define SBI_RFENCE_SFENCE_VMA_ASID 2 // ... and asid after size
+#define SBI_EXT_SRST 0x53525354    // "SRST": system reset
+#define SBI_SRST_RESET 0           // sbi_system_reset(reset_type, reset_reason)
+#define SBI_SRST_SHUTDOWN 0        // reset_type: power off
+
+// Console
+// Output is collected in a ring and handed to the firmware a line at a time,
+// or to the UART once uart_init has taken over the console
+#define CONSOLE_BUF_SIZE 1024      // Ring size in bytes (power of two)
+#define CONSOLE_DEFAULT 0          // Backend: the UART if set up, else the firmware
+#define CONSOLE_UART 1             // Backend: the UART's transmit FIFO
+#define CONSOLE_DBCN 2             // Backend: SBI debug console, one call per run
+#define CONSOLE_LEGACY 3           // Backend: legacy SBI putchar, one call per byte
+
 // System Interface
 // Return values from SBI (Supervisor Binary Interface) calls
 struct ret_sbi {
@@ -115,16 +524,99 @@ struct ret_sbi {
 // System Interface
 struct ret_sbi call_sbi(long arg0, long arg1, long arg2, long arg3, long arg4,
                         long arg5, long fid, long eid);  // Make SBI call
-void putchar(char ch);                                  // Output character
+void putchar(char ch);                                  // Queue a character
+void console_write(const char *s, size_t len);          // Queue a string
+void console_write_to(const char *s, size_t len,
+                      uint32_t backend);                // ... through a backend
+void console_init(void);                                // Probe for DBCN
+void console_flush(void);                               // Write out queued output
+void console_flush_to(uint32_t backend);                // ... through a backend
+void console_kick(void);                                // Start writing it out
+uint32_t console_read(char *buf, uint32_t len);         // Blocking input
+void console_report(void);                              // Print output counters
+void uart_init(void);                                   // Take over the console
+uint64_t read_time(void);                               // Current time CSR value
+void set_timer(uint64_t when);                          // Arm the timer interrupt
+
+// Memory Management
+paddr_t alloc_pages(uint32_t n);                       // Allocate zeroed pages
+void free_pages(paddr_t paddr, uint32_t n);            // Release pages
+void zero_pool_report(void);                           // Print pool hits
+void kmem_cache_init(struct kmem_cache *cache, const char *name,
+                     uint32_t obj_size,
+                     void (*ctor)(void *obj));          // Set up an object cache
+void *kmem_cache_alloc(struct kmem_cache *cache);       // Allocate an object
+void kmem_cache_free(struct kmem_cache *cache, void *obj); // Release an object
+void kmalloc_init(void);                               // Set up the size classes
+void *kmalloc(size_t size);                            // Allocate heap memory
+void kfree(void *ptr);                                 // Release heap memory
+void kmalloc_report(void);                             // Print slab usage
+void map_page(uint32_t *table1, uint32_t vaddr, paddr_t paddr,
+              uint32_t flags);                         // Map one 4KB page
+void map_range(uint32_t *table1, uint32_t vaddr, paddr_t paddr, uint32_t size,
+               uint32_t flags);                        // Map with megapages
+uint32_t *lookup_pte(uint32_t *table1, vaddr_t vaddr);  // Find a level-0 PTE
+void page_get(paddr_t paddr);                          // Add a page reference
+void page_put(paddr_t paddr);                          // Drop one, free at zero
+void tlb_batch_init(struct tlb_batch *batch,
+                    struct process *proc);             // Start gathering
+void tlb_batch_add(struct tlb_batch *batch, vaddr_t vaddr); // Note a changed page
+void tlb_batch_flush(struct tlb_batch *batch);         // Invalidate everywhere
+void tlb_report(void);                                 // Print shootdown stats
+
+// Process Management
+struct process *create_process(uint32_t pc);           // Kernel thread running pc
+struct process *create_user_process(const void *image,
+                                    size_t image_size); // Queued U-mode process
+void wake_up_new(struct process *proc);                // Queue a new process
+void set_priority(struct process *proc, int priority); // 0 is the highest
+void yeild(void);                                      // Let another process run
+uint32_t free_memory_pages(void);                      // Pages left to allocate
+uint32_t latency_percentile(struct latency_hist *hist,
+                            uint32_t percent);         // Bucket bound, in ticks
+void sleep_on(struct list_node *wq,
+              struct spinlock *lock);                  // Block on a wait queue
+void wake_up(struct list_node *wq);                    // Wake its sleepers
+void send_ipi(uint32_t hart_mask);                     // Interrupt other harts
+void sleep_jiffies(uint32_t n);                        // Block for n sleep ticks
+void timer_setup(struct timer *timer, void (*fn)(void *arg),
+                 void *arg);                           // Prepare a timer
+void timer_arm(struct timer *timer, uint32_t delay,
+               uint32_t period);                       // Start it (jiffies)
+bool timer_cancel(struct timer *timer);                // Stop it if pending
+void timer_report(void);                               // Print expiry jitter
+void idle_report(void);                                // Print idle time per hart
+uint64_t cpu_idle_time(struct cpu *cpu);               // Ticks in wfi so far
+
+// Synchronization
+void spin_init(struct spinlock *lock, const char *name); // Set up a lock
+void spin_lock(struct spinlock *lock);                 // Acquire, masking interrupts
+void spin_unlock(struct spinlock *lock);               // Release
+uint32_t spin_lock_irqsave(struct spinlock *lock);     // Acquire, return irq state
+void spin_unlock_irqrestore(struct spinlock *lock,
+                            uint32_t flags);           // Release, restore it
+void ticket_init(struct ticketlock *lock, const char *name); // Set up a lock
+void ticket_lock(struct ticketlock *lock);             // Wait for our turn
+void ticket_unlock(struct ticketlock *lock);           // Serve the next ticket
+void lock_report(void);                                // Print lock statistics
+
+// Tracing
+void trace_dump(void);                                 // Print the trace rings
+
+// Benchmarks
+void bench_main(void);                                 // Harness (run.sh bench)
 
 // System Control
-void kernel_main(void);                                // Kernel entry point
+void kernel_main(uint32_t hartid);                     // Boot hart entry point
+void secondary_main(uint32_t hartid);                  // Other harts' entry point
+void stats_report(void);                               // Print every report
 
 // Error Handling
 // PANIC macro for system errors - prints message and halts
 #define PANIC(fmt, ...)                                                        \
   do {                                                                         \
     printf("PANIC: %s:%d: " fmt "\n", __FILE__, __LINE__, ##__VA_ARGS__);      \
+    console_flush();                                                           \
     while (1) {                                                                \
     }                                                                          \
   } while (0)
@@ -8,27 +8,40 @@
 #    - Linker configuration
 # 
 # 2. Kernel Building
-#    - Compiles kernel.c and common.c
+#    - Builds the user program (app.c) into a flat binary image
+#    - Compiles kernel.c and common.c with the embedded image
 #    - Links with kernel.ld
 #    - Generates map file for debugging
 # 
 # 3. QEMU Configuration
 #    - RISC-V 32-bit machine
 #    - VirtIO platform
+#    - Four harts by default
+#    - 256MB of RAM, enough for the 192MB of free RAM kernel.ld sets aside
 #    - Serial console setup
 # 
 # 4. Debug Support
 #    - Generates debug symbols
 #    - Creates memory map
 #    - Enables QEMU monitor
+#
+# 5. Benchmarks (./run.sh bench)
+#    - Builds bench_user.c as the user program and adds bench.c (-DBENCH)
+#    - Boots once per hart count in BENCH_SMP (default "1 4"); the kernel
+#      powers off when done
+#    - Keeps each run's log in bench-<harts>.log and every result, tagged
+#      with its hart count, in bench.jsonl
 
 set -xue  # Enable strict error checking and command echoing
 
+MODE=${1:-run}
+
 # QEMU configuration for RISC-V 32-bit
 QEMU=qemu-system-riscv32
 
 # Compiler configuration
 CC=/usr/bin/clang
+OBJCOPY=/usr/bin/llvm-objcopy
 # Compiler flags:
 # -std=c11: Use C11 standard
 # -O2: Optimize for speed
@@ -39,21 +52,57 @@ CC=/usr/bin/clang
 # -nostdlib: Don't link standard library
 CFLAGS="-std=c11 -O2 -g3 -Wall -Wextra --target=riscv32 -ffreestanding -nostdlib"
 
+# Sources: the benchmark build swaps the user program and adds the harness
+APP_SRCS="app.c"
+KERNEL_SRCS="kernel.c common.c"
+if [ "$MODE" = bench ]; then
+    APP_SRCS="bench_user.c"
+    KERNEL_SRCS="$KERNEL_SRCS bench.c"
+    CFLAGS="$CFLAGS -DBENCH"
+fi
+
+# Build the user program
+# -Wl,-Tuser.ld: Link at USER_BASE using user.ld
+# objcopy -O binary: Strip the ELF into a flat image (bss included as zeros)
+# objcopy -Ibinary: Wrap the image in an object file so the kernel can link it;
+#                   this defines _binary_app_bin_start and _binary_app_bin_size
+$CC $CFLAGS -Wl,-Tuser.ld -Wl,-Map=app.map -o app.elf $APP_SRCS user.c common.c
+$OBJCOPY --set-section-flags .bss=alloc,contents -O binary app.elf app.bin
+$OBJCOPY -Ibinary -Oelf32-littleriscv app.bin app.bin.o
+
 # Build the kernel
 # -Wl,-Tkernel.ld: Use kernel.ld as linker script
 # -Wl,-Map=kernel.map: Generate memory map
 # -o kernel.elf: Output ELF binary
 $CC $CFLAGS -Wl,-Tkernel.ld -Wl,-Map=kernel.map -o kernel.elf \
-    kernel.c common.c
+    $KERNEL_SRCS app.bin.o
 # Note: -Wl, passes options to the linker instead of the C compiler.
 # clang command does C compilation and executes the linker internally.
 
+# Run the benchmarks
+# Result lines are the ones starting with {"bench" (any \r from the serial
+# console is dropped first)
+# timeout: a hung run must not stall the rest (BENCH_TIMEOUT seconds)
+if [ "$MODE" = bench ]; then
+    rm -f bench.jsonl
+    for harts in ${BENCH_SMP:-1 4}; do
+        timeout ${BENCH_TIMEOUT:-600} $QEMU -machine virt -bios default \
+            -nographic -serial mon:stdio --no-reboot -m 256M -smp $harts \
+            -kernel kernel.elf < /dev/null | tee bench-$harts.log
+        tr -d '\r' < bench-$harts.log | grep '^{"bench"' |
+            sed "s/}\$/,\"harts\":$harts}/" >> bench.jsonl
+    done
+    exit 0
+fi
+
 # Start QEMU with kernel
 # -machine virt: Use VirtIO platform
 # -bios default: Use default BIOS
 # -nographic: No graphical output
 # -serial mon:stdio: Use stdio for serial console and QEMU monitor
 # --no-reboot: Don't reboot on kernel panic
+# -m 256M: RAM size; kernel.ld's free RAM must fit below its end
+# -smp: Number of harts (SMP=n overrides, at most MAX_HARTS in kernel.h)
 # -kernel kernel.elf: Load kernel binary
 $QEMU -machine virt -bios default -nographic -serial mon:stdio --no-reboot \
-    -kernel kernel.elf
+    -m 256M -smp ${SMP:-4} -kernel kernel.elf
@@ -0,0 +1,238 @@
+#!/usr/bin/env python3
+"""
+Trace Timeline Tool
+
+Turns the kernel's per-hart trace rings into a timeline:
+1. Input
+   - A console log holding the output of trace_dump() (T lines)
+   - Or a raw dump of trace_rings, saved from the QEMU monitor with
+     pmemsave <address of trace_rings from kernel.map> <size> trace.bin
+
+2. Output
+   - One line per event, all harts merged in time order
+   - The longest trap handlers and the longest run-queue waits (wake to
+     switch in). A handler's time starts after kernel_entry has saved the
+     registers and ends before it restores them
+   - Optionally a Chrome trace file (--chrome) with a track per hart, for
+     chrome://tracing or ui.perfetto.dev
+
+Usage:
+  ./trace.py console.log
+  ./trace.py --dump trace.bin [--harts 8] [--entries 1024]
+  ./trace.py console.log --chrome trace.json
+"""
+
+import argparse
+import json
+import struct
+import sys
+
+TIMEBASE_HZ = 10000000  # time CSR frequency on QEMU virt (kernel.h)
+
+# TRACE_* event types (kernel.h)
+EVENTS = {
+    1: "switch",
+    2: "handler",
+    3: "handler-exit",
+    4: "page-fault",
+    5: "alloc",
+    6: "free",
+    7: "wake",
+    8: "timer",
+    9: "mark",
+}
+
+SCAUSES = {
+    0x80000001: "ipi",
+    0x80000005: "timer-irq",
+    0x80000009: "external-irq",
+    3: "breakpoint",
+    8: "ecall",
+    12: "inst-fault",
+    13: "load-fault",
+    15: "store-fault",
+}
+
+
+def parse_console(path):
+    """Events per hart from trace_dump() output, plus the dump's time CSR"""
+    harts = {}
+    now = None
+    with open(path, errors="replace") as f:
+        for line in f:
+            line = line.strip()
+            if line.startswith("trace: now="):
+                now = int(line.split()[1].split("=")[1], 16)
+            elif line.startswith("T "):
+                fields = line.split()
+                if len(fields) != 6:
+                    continue
+                hart = int(fields[1])
+                event = (int(fields[2], 16), int(fields[3]), int(fields[4], 16),
+                         int(fields[5], 16))
+                harts.setdefault(hart, []).append(event)
+    return harts, now
+
+
+def parse_dump(path, nharts, entries):
+    """Events per hart from a raw copy of trace_rings[] (struct trace_ring)"""
+    with open(path, "rb") as f:
+        data = f.read()
+    ring_size = 16 + 16 * entries
+    harts = {}
+    for hart in range(nharts):
+        base = hart * ring_size
+        if base + ring_size > len(data):
+            break
+        (head,) = struct.unpack_from("<I", data, base)
+        first = max(head - entries, 0)
+        events = []
+        for i in range(first, head):
+            off = base + 16 + 16 * (i % entries)
+            events.append(struct.unpack_from("<IIII", data, off))
+        if events:
+            harts[hart] = events
+    return harts, None
+
+
+def unwrap(harts, now):
+    """Widen each hart's 32-bit times, oldest first, into one timeline
+
+    Each ring is in time order, so a time smaller than the one before means
+    the low word wrapped. With the dump's full time CSR the result is
+    absolute; otherwise every hart is taken to start in the same 2^32-tick
+    period (about 7 minutes).
+    """
+    timeline = []
+    for hart, events in harts.items():
+        high = 0
+        prev = None
+        widened = []
+        for time, kind, a, b in events:
+            if prev is not None and time < prev:
+                high += 1 << 32
+            prev = time
+            widened.append([high + time, hart, kind, a, b])
+        if now is not None and widened:
+            # Shift the hart so its newest event falls just before the dump
+            last = widened[-1][0]
+            shift = now - ((now - last) & 0xFFFFFFFF) - last
+            for event in widened:
+                event[0] += shift
+        timeline.extend(widened)
+    timeline.sort(key=lambda e: e[0])
+    return timeline
+
+
+def describe(kind, a, b):
+    if kind == 1:
+        return "%d -> %d" % (a, b)
+    if kind in (2, 3):
+        cause = SCAUSES.get(a, "scause=%x" % a)
+        return cause + (" sepc=%x" % b if kind == 2 else "")
+    if kind == 4:
+        return "addr=%x %s" % (a, SCAUSES.get(b, b))
+    if kind in (5, 6):
+        return "paddr=%x pages=%d" % (a, b)
+    if kind == 7:
+        return "pid %d on hart %d" % (a, b)
+    if kind == 8:
+        return "fn=%x late=%.1fus" % (a, b * 1e6 / TIMEBASE_HZ)
+    return "%x %x" % (a, b)
+
+
+def us(ticks):
+    return ticks * 1e6 / TIMEBASE_HZ
+
+
+def print_timeline(timeline):
+    start = timeline[0][0]
+    print("%12s  %4s  %-10s  %s" % ("time(us)", "hart", "event", "details"))
+    for time, hart, kind, a, b in timeline:
+        print("%12.1f  %4d  %-10s  %s" % (us(time - start), hart,
+                                          EVENTS.get(kind, str(kind)),
+                                          describe(kind, a, b)))
+
+
+def print_outliers(timeline, count=5):
+    """Longest trap handlers per hart and longest waits from wakeup to switch in"""
+    traps = []
+    entered = {}
+    waits = []
+    woken = {}
+    for time, hart, kind, a, b in timeline:
+        if kind == 2:
+            # Traps nest (an interrupt inside a syscall), so keep a stack
+            entered.setdefault(hart, []).append((time, a))
+        elif kind == 3 and entered.get(hart):
+            begin, cause = entered[hart].pop()
+            traps.append((time - begin, hart, cause, begin))
+        elif kind == 7:
+            woken[a] = time
+        elif kind == 1 and b in woken:
+            waits.append((time - woken.pop(b), hart, b, time))
+
+    start = timeline[0][0]
+    print("\nlongest trap handlers:")
+    for length, hart, cause, begin in sorted(traps, reverse=True)[:count]:
+        print("  %8.1fus  hart %d  %-12s at %.1fus" % (
+            us(length), hart, SCAUSES.get(cause, "%x" % cause), us(begin - start)))
+    print("longest wake-to-run waits:")
+    for length, hart, pid, time in sorted(waits, reverse=True)[:count]:
+        print("  %8.1fus  hart %d  pid %d at %.1fus" % (
+            us(length), hart, pid, us(time - start)))
+
+
+def write_chrome(timeline, path):
+    """Chrome trace format: running processes and traps as slices per hart"""
+    start = timeline[0][0]
+    out = []
+    running = {}
+    for time, hart, kind, a, b in timeline:
+        ts = us(time - start)
+        if kind == 1:
+            if hart in running:
+                pid, since = running[hart]
+                out.append({"name": "pid %d" % pid, "ph": "X", "ts": since,
+                            "dur": ts - since, "pid": 0, "tid": hart})
+            running[hart] = (b, ts)
+        elif kind == 2:
+            out.append({"name": SCAUSES.get(a, "trap"), "ph": "B", "ts": ts,
+                        "pid": 1, "tid": hart})
+        elif kind == 3:
+            out.append({"ph": "E", "ts": ts, "pid": 1, "tid": hart})
+        else:
+            out.append({"name": EVENTS.get(kind, str(kind)), "ph": "i", "s": "t",
+                        "ts": ts, "pid": 1, "tid": hart,
+                        "args": {"details": describe(kind, a, b)}})
+    with open(path, "w") as f:
+        json.dump({"traceEvents": out, "displayTimeUnit": "ns"}, f)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Kernel trace timeline")
+    parser.add_argument("log", nargs="?", help="console log with trace_dump output")
+    parser.add_argument("--dump", help="raw trace_rings memory dump")
+    parser.add_argument("--harts", type=int, default=8, help="MAX_HARTS")
+    parser.add_argument("--entries", type=int, default=1024, help="TRACE_ENTRIES")
+    parser.add_argument("--chrome", help="also write a Chrome trace JSON file")
+    args = parser.parse_args()
+
+    if args.dump:
+        harts, now = parse_dump(args.dump, args.harts, args.entries)
+    elif args.log:
+        harts, now = parse_console(args.log)
+    else:
+        parser.error("give a console log or --dump")
+
+    timeline = unwrap(harts, now)
+    if not timeline:
+        sys.exit("no trace events found")
+    print_timeline(timeline)
+    print_outliers(timeline)
+    if args.chrome:
+        write_chrome(timeline, args.chrome)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,126 @@
+/*
+ * User Library
+ * 
+ * This file is linked into every user program and provides:
+ * 1. Program Startup
+ *    - start: points sp at the demand-paged user stack and calls main
+ *    - exit is called automatically when main returns
+ * 
+ * 2. System Call Interface
+ *    - syscall: issues ecall with the number in a7
+ *    - Wrappers for each system call the kernel implements
+ * 
+ * User programs run in U-mode at USER_BASE and can only reach the
+ * kernel through these wrappers.
+ */
+
+#include "user.h"
+
+// System Calls
+// Trap into the kernel
+// The syscall number goes in a7 and arguments in a0-a2, matching the order
+// handle_syscall reads them from the trap frame; the result comes back in a0
+int syscall(int sysno, int arg0, int arg1, int arg2) {
+  register int a0 __asm__("a0") = arg0;
+  register int a1 __asm__("a1") = arg1;
+  register int a2 __asm__("a2") = arg2;
+  register int a7 __asm__("a7") = sysno;
+
+  __asm__ __volatile__("ecall"
+                       : "=r"(a0)
+                       : "r"(a0), "r"(a1), "r"(a2), "r"(a7)
+                       : "memory");
+  return a0;
+}
+
+// Output a character to the console
+void putchar(char ch) {
+  syscall(SYS_PUTCHAR, ch, 0, 0);
+}
+
+// Return the id of the calling process
+int getpid(void) {
+  return syscall(SYS_GETPID, 0, 0, 0);
+}
+
+// Give up the rest of the time slice
+void yield(void) {
+  syscall(SYS_YIELD, 0, 0, 0);
+}
+
+// Terminate the calling process
+__attribute__((noreturn)) void exit(void) {
+  syscall(SYS_EXIT, 0, 0, 0);
+  for (;;); // Just in case!
+}
+
+// Move the end of the heap by increment bytes
+// Returns the previous end, or (void *)-1 on failure
+void *sbrk(int increment) {
+  return (void *)syscall(SYS_SBRK, increment, 0, 0);
+}
+
+// Create a copy of the calling process
+// Returns the child's pid in the parent and 0 in the child
+int fork(void) {
+  return syscall(SYS_FORK, 0, 0, 0);
+}
+
+// Like fork, but the child gets a private copy of every page up front
+// instead of sharing them copy-on-write (the baseline bench_user.c times
+// copy-on-write against)
+int fork_copy(void) {
+  return syscall(SYS_FORK, FORK_COPY, 0, 0);
+}
+
+// Read up to len bytes of console input into buf
+// Blocks until at least one byte is available; returns the number read
+int read(char *buf, int len) {
+  return syscall(SYS_READ, (int)buf, len, 0);
+}
+
+// Write len bytes from buf to the console
+int write(const char *buf, int len) {
+  return syscall(SYS_WRITE, (int)buf, len, 0);
+}
+
+// Block for ticks timer ticks (TICK_HZ per second)
+// Returns 0, or -1 if ticks is negative or too long for the kernel's timers
+int sleep(int ticks) {
+  return syscall(SYS_SLEEP, ticks, 0, 0);
+}
+
+// Block until process pid has exited and its memory has been freed
+// Returns 0, or -1 if there is no such process or it is the caller
+int wait(int pid) {
+  return syscall(SYS_WAIT, pid, 0, 0);
+}
+
+// Output sink for printf in common.c: one system call per message
+void console_write(const char *s, size_t len) {
+  write(s, len);
+}
+
+// Wait for and return the next input character
+int getchar(void) {
+  char ch;
+  read(&ch, 1);
+  return ch;
+}
+
+// Program Startup
+// First instruction of every user image
+// Switches to the user stack, runs main and exits when it returns
+// The stack lives in a VMA below USER_STACK_TOP that the kernel backs with
+// memory as it grows
+__attribute__((section(".text.start")))
+__attribute__((naked))
+void start(void) {
+  __asm__ __volatile__(
+      "li sp, %[stack_top]\n"
+      "call main\n"
+      "call exit\n"
+      :
+      : [stack_top] "i"(USER_STACK_TOP)
+  );
+}
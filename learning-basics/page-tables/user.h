@@ -0,0 +1,34 @@
+/*
+ * User Library Header File
+ * 
+ * This header declares what user programs can call:
+ * 1. System Calls
+ *    - Thin wrappers that trap into the kernel with ecall
+ *    - Syscall number in a7, arguments in a0-a2, result in a0
+ * 
+ * 2. Program Control
+ *    - exit to terminate the calling process
+ *    - yield to give up the CPU voluntarily
+ * 
+ * 3. Console I/O
+ *    - read blocks until input arrives; getchar reads a single character
+ *    - write prints a whole buffer with one system call
+ */
+
+#pragma once
+#include "common.h"
+
+// System Calls
+int syscall(int sysno, int arg0, int arg1, int arg2); // Raw system call
+void putchar(char ch);                               // Output a character
+int getpid(void);                                    // Current process id
+void yield(void);                                    // Give up the CPU
+__attribute__((noreturn)) void exit(void);           // Terminate the process
+void *sbrk(int increment);                           // Grow or shrink the heap
+int fork(void);                                      // Clone the process
+int fork_copy(void);                                 // Clone, copying every page
+int read(char *buf, int len);                        // Console input (blocks)
+int write(const char *buf, int len);                 // Console output
+int getchar(void);                                   // Read one character
+int sleep(int ticks);                                // Block for ticks/TICK_HZ s
+int wait(int pid);                                   // Block until pid exits